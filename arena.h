@@ -0,0 +1,72 @@
+//
+// Created by timmytonga on 8/16/18.
+//
+
+#ifndef MAPREDUCECPP_ARENA_H
+#define MAPREDUCECPP_ARENA_H
+
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#define ARENA_CHUNK (64 * 1024) // bytes per arena chunk (bigger strings get a chunk of their own)
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+/* Bump allocator for key bytes. Strings copied in stay put until the arena is cleared or destroyed, so string_views
+ * into it can be used as keys. Nothing is freed one by one: the chunks go all at once. Not thread safe, each map
+ * thread has its own (inside its KeyValue). */
+class Arena {
+public:
+    Arena() : cur(NULL), left(0), used(0) {}
+    ~Arena() { clear(); }
+    Arena(const Arena &) = delete;
+    Arena & operator=(const Arena &) = delete;
+
+    std::string_view copy(std::string_view s) {
+        if (s.size() > left) grow(s.size());
+        char *out = cur;
+        memcpy(out, s.data(), s.size());
+        cur += s.size();
+        left -= s.size();
+        return std::string_view(out, s.size());
+    }
+
+    void adopt(Arena &other) { // take over other's chunks (views into them stay valid), other is left empty
+        chunks.insert(chunks.end(), other.chunks.begin(), other.chunks.end());
+        used += other.used;
+        other.chunks.clear();
+        other.cur = NULL;
+        other.left = 0;
+        other.used = 0;
+    }
+
+    void clear() {
+        for (auto c : chunks) delete[] c;
+        chunks.clear();
+        cur = NULL;
+        left = 0;
+        used = 0;
+    }
+
+    size_t bytes() const { return used; } // memory held by the chunks
+
+private:
+    std::vector<char *> chunks;
+    char *cur;      // next free byte of the newest chunk
+    size_t left;    // free bytes after cur
+    size_t used;
+
+    void grow(size_t atleast) {
+        size_t size = atleast > ARENA_CHUNK ? atleast : ARENA_CHUNK;
+        cur = new char[size];
+        chunks.push_back(cur);
+        left = size;
+        used += size;
+    }
+};
+
+} // namespace
+
+#endif //MAPREDUCECPP_ARENA_H
@@ -0,0 +1,168 @@
+//
+// Created by timmytonga on 8/14/18.
+//
+
+#ifndef MAPREDUCECPP_FLATMAP_H
+#define MAPREDUCECPP_FLATMAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+template<class K>
+struct flatHash { // std::hash, except string keys hash as string_view so they can be looked up without a copy
+    size_t operator()(const K &k) const { return std::hash<K>()(k); }
+};
+
+template<>
+struct flatHash<std::string> {
+    size_t operator()(std::string_view k) const { return std::hash<std::string_view>()(k); }
+};
+
+/* FlatMap is the hash table behind KeyValue. The (key, value) entries live contiguously in a vector, in insertion
+ * order, so iterating is a linear scan. Lookups go through an open addressing index (linear probing, Robin Hood
+ * displacement) of 8 byte slots holding the entry number and 32 bits of its mixed hash: most probes never touch a
+ * key and a miss stops as soon as it meets a slot that is closer to its home than we are to ours.
+ * There is no erase; the map is only ever cleared. Entries are in no particular order until sort() is called. */
+template<class K, class V, class Hash = flatHash<K>>
+class FlatMap {
+public:
+    typedef std::pair<K, V> value_type;
+    typedef typename std::vector<value_type>::iterator iterator;
+    typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+    FlatMap() : bits(0) { rehash(16); }
+
+    iterator begin() { return entries.begin(); }
+    iterator end() { return entries.end(); }
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+
+    template<class L> // L is K or anything Hash and K's operator== accept (string_view for string keys)
+    iterator find(const L &key) {
+        uint32_t tag = make_tag(key);
+        uint32_t index = lookup(key, tag);
+        return index == EMPTY ? entries.end() : entries.begin() + index;
+    }
+
+    template<class L> // the value for key, default constructed (and the key copied in) if it's not there yet
+    V & find_or_insert(const L &key) {
+        return find_or_insert(key, [](const L &k) { return K(k); });
+    }
+
+    template<class L, class Make> // same but make(key) builds the K to store, only called when key is new
+    V & find_or_insert(const L &key, Make make) {
+        uint32_t tag = make_tag(key);
+        uint32_t index = lookup(key, tag);
+        if (index != EMPTY) return entries[index].second;
+        if ((entries.size() + 1) * 5 > slots.size() * 4) { // keep the load factor under 0.8
+            rehash(slots.size() * 2);
+        }
+        index = (uint32_t) entries.size();
+        entries.emplace_back(make(key), V());
+        place(slot{index, tag});
+        return entries.back().second;
+    }
+
+    V & operator[](const K &key) { return find_or_insert(key); }
+
+    void clear() {
+        entries.clear();
+        std::fill(slots.begin(), slots.end(), slot{EMPTY, 0});
+    }
+
+    void reserve(size_t n) {
+        entries.reserve(n);
+        size_t cap = slots.size();
+        while (n * 5 > cap * 4) cap *= 2;
+        if (cap != slots.size()) rehash(cap);
+    }
+
+    template<class Compare> // order the entries (for output) and reindex them
+    void sort(Compare compare) {
+        std::sort(entries.begin(), entries.end(),
+                  [&compare](const value_type &a, const value_type &b) { return compare(a.first, b.first); });
+        reindex();
+    }
+
+    void take_entries(std::vector<value_type> &out) { // move every entry to out, leaving the map empty
+        out.swap(entries);
+        clear();
+    }
+
+private:
+    static const uint32_t EMPTY = UINT32_MAX;
+    struct slot {
+        uint32_t index;     // position in entries, EMPTY if the slot is free
+        uint32_t tag;       // top 32 bits of the mixed hash: the high bits pick the home slot
+    };
+    std::vector<value_type> entries;
+    std::vector<slot> slots;    // power of two sized
+    int bits;                   // log2(slots.size())
+
+    template<class L>
+    static uint32_t make_tag(const L &key) {
+        // Fibonacci hashing spreads std::hash's (often identity) output over the high bits
+        return (uint32_t) (((uint64_t) Hash()(key) * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+    size_t home(uint32_t tag) const { return bits == 0 ? 0 : tag >> (32 - bits); }
+    size_t distance(size_t pos, uint32_t tag) const { return (pos - home(tag)) & (slots.size() - 1); }
+
+    template<class L>
+    uint32_t lookup(const L &key, uint32_t tag) const {
+        size_t mask = slots.size() - 1, pos = home(tag), dist = 0;
+        while (1) {
+            const slot &s = slots[pos];
+            if (s.index == EMPTY || distance(pos, s.tag) < dist) return EMPTY; // it would have been placed here
+            if (s.tag == tag && entries[s.index].first == key) return s.index;
+            pos = (pos + 1) & mask;
+            dist++;
+        }
+    }
+
+    void place(slot s) { // Robin Hood: take the slot of anyone closer to their home than we are to ours
+        size_t mask = slots.size() - 1, pos = home(s.tag), dist = 0;
+        while (1) {
+            if (slots[pos].index == EMPTY) {
+                slots[pos] = s;
+                return;
+            }
+            size_t theirs = distance(pos, slots[pos].tag);
+            if (theirs < dist) {
+                std::swap(s, slots[pos]);
+                dist = theirs;
+            }
+            pos = (pos + 1) & mask;
+            dist++;
+        }
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<slot> old;
+        old.swap(slots);
+        slots.assign(capacity, slot{EMPTY, 0});
+        bits = 0;
+        while (((size_t) 1 << bits) < capacity) bits++;
+        for (auto &s : old)
+            if (s.index != EMPTY) place(s);
+    }
+
+    void reindex() { // entries moved around: rebuild the index from the keys
+        std::fill(slots.begin(), slots.end(), slot{EMPTY, 0});
+        for (size_t i = 0; i < entries.size(); i++)
+            place(slot{(uint32_t) i, make_tag(entries[i].first)});
+    }
+};
+
+} // namespace
+
+#endif //MAPREDUCECPP_FLATMAP_H
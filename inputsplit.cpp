@@ -0,0 +1,171 @@
+//
+// Created by timmytonga on 8/9/18.
+//
+
+#include "inputsplit.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_TOKENIZER // SSE2 or AVX2 when the cpu has them (picked at run time), else scalar
+#endif
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+    static inline bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    /* The tokenizer works on 64 byte blocks: space_mask(p) has bit i set if p[i] is whitespace, and every token
+     * inside a block then costs a couple of bit operations. The vector versions classify a whole register at once:
+     * a byte is whitespace if it is ' ' or in '\t'..'\r', i.e. (c - 9) <= 4 unsigned, and movemask packs the
+     * comparison into one bit per byte */
+    static uint64_t space_mask_scalar(const char *p) {
+        uint64_t mask = 0;
+        for (int i = 0; i < 64; i++)
+            if (is_space(p[i])) mask |= 1ULL << i;
+        return mask;
+    }
+
+#ifdef SIMD_TOKENIZER
+    __attribute__((target("sse2"))) // always there on x86_64, not on every i386
+    static uint64_t space_mask_sse2(const char *p) {
+        const __m128i blank = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+        uint64_t mask = 0;
+        for (int i = 0; i < 64; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+            __m128i t = _mm_sub_epi8(v, tab);
+            __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, blank), _mm_cmpeq_epi8(_mm_min_epu8(t, four), t));
+            mask |= (uint64_t) (unsigned) _mm_movemask_epi8(space) << i;
+        }
+        return mask;
+    }
+
+    __attribute__((target("avx2")))
+    static uint64_t space_mask_avx2(const char *p) {
+        const __m256i blank = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), four = _mm256_set1_epi8(4);
+        uint64_t mask = 0;
+        for (int i = 0; i < 64; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+            __m256i t = _mm256_sub_epi8(v, tab);
+            __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, blank),
+                                            _mm256_cmpeq_epi8(_mm256_min_epu8(t, four), t));
+            mask |= (uint64_t) (unsigned) _mm256_movemask_epi8(space) << i;
+        }
+        return mask;
+    }
+#endif
+
+    static uint64_t (*pick_space_mask())(const char *) {
+#ifdef SIMD_TOKENIZER
+        if (__builtin_cpu_supports("avx2")) return space_mask_avx2;
+        if (__builtin_cpu_supports("sse2")) return space_mask_sse2;
+#endif
+        return space_mask_scalar;
+    }
+
+    static uint64_t (*const space_mask)(const char *) = pick_space_mask();
+
+    InputSplit::InputSplit(const fileSplit &s)
+            : split(s), map(NULL), mapLength(0), pos(NULL), end(NULL), fileEnd(NULL), block(NULL), tokenEnd(NULL),
+              spaces(0), open(false) {
+        int fd = ::open(split.fileName.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat filestat;
+        if (fstat(fd, &filestat) != 0) {
+            close(fd);
+            return;
+        }
+        open = true;
+        long fileSize = filestat.st_size;
+        if (split.offset >= fileSize) { // nothing to read (empty file)
+            close(fd);
+            return;
+        }
+        long pagesize = sysconf(_SC_PAGESIZE);
+        long mapStart = split.offset > 0 ? ((split.offset - 1) / pagesize) * pagesize : 0;
+        mapLength = (size_t) (fileSize - mapStart);
+        void *m = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fd, mapStart);
+        close(fd); // the mapping keeps the file referenced
+        if (m == MAP_FAILED) {
+            open = false;
+            mapLength = 0;
+            return;
+        }
+        map = (char *) m;
+        madvise(map, mapLength, MADV_SEQUENTIAL);
+        fileEnd = map + mapLength;
+        pos = map + (split.offset - mapStart);
+        long stop = split.offset + split.length;
+        end = stop < fileSize ? map + (stop - mapStart) : fileEnd;
+        if (split.offset > 0) {
+            // we may be in the middle of a line that belongs to the previous split: skip past the next '\n'.
+            // Starting one byte early means a line beginning exactly at offset is kept.
+            const char *nl = (const char *) memchr(pos - 1, '\n', fileEnd - (pos - 1));
+            pos = nl != NULL ? nl + 1 : fileEnd;
+        }
+    }
+
+    InputSplit::~InputSplit() {
+        if (map != NULL) munmap(map, mapLength);
+    }
+
+    bool InputSplit::next_record(std::string_view &record) {
+        if (pos == NULL || pos >= end) return false;
+        const char *nl = (const char *) memchr(pos, '\n', fileEnd - pos);
+        const char *lineEnd = nl != NULL ? nl : fileEnd;
+        record = std::string_view(pos, lineEnd - pos);
+        pos = nl != NULL ? nl + 1 : fileEnd;
+        return true;
+    }
+
+    uint64_t InputSplit::block_mask() const {
+        if (tokenEnd - block >= 64) return space_mask(block);
+        char tail[64]; // the last block: whatever is past tokenEnd counts as whitespace
+        memset(tail, ' ', sizeof(tail));
+        memcpy(tail, block, tokenEnd - block);
+        return space_mask(tail);
+    }
+
+    bool InputSplit::next_token(std::string_view &token) {
+        if (block == NULL) {
+            // tokens don't care about line breaks ('\n' is whitespace) so we scan the rest of our lines in one
+            // piece: up to the end of the line that is running at end
+            if (pos == NULL || pos >= end) return false;
+            const char *nl = (const char *) memchr(end - 1, '\n', fileEnd - (end - 1));
+            tokenEnd = nl != NULL ? nl + 1 : fileEnd;
+            block = pos;
+            pos = tokenEnd;
+            spaces = block_mask();
+        }
+        uint64_t words = ~spaces; // bytes already handed out are marked as whitespace
+        while (words == 0) {
+            block += 64;
+            if (block >= tokenEnd) return false;
+            spaces = block_mask();
+            words = ~spaces;
+        }
+        const char *start = block + __builtin_ctzll(words);
+        uint64_t after = spaces & (~0ULL << __builtin_ctzll(words));
+        while (after == 0) { // the token goes on in the next block
+            block += 64;
+            if (block >= tokenEnd) {
+                token = std::string_view(start, tokenEnd - start);
+                spaces = ~0ULL;
+                return true;
+            }
+            spaces = block_mask();
+            after = spaces;
+        }
+        int stop = __builtin_ctzll(after);
+        token = std::string_view(start, block + stop - start);
+        spaces |= (1ULL << stop) - 1;
+        return true;
+    }
+
+}
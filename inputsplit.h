@@ -0,0 +1,74 @@
+//
+// Created by timmytonga on 8/9/18.
+//
+
+#ifndef MAPREDUCECPP_INPUTSPLIT_H
+#define MAPREDUCECPP_INPUTSPLIT_H
+
+#include "serializer.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+struct fileSplit { // the byte range [offset, offset + length) of an input file that one map task processes
+    std::string fileName;
+    long offset;
+    long length;
+};
+
+/* InputSplit reads the records (lines) of a fileSplit. A split owns every line that *starts* inside its range:
+ * if the range begins in the middle of a line, that partial line is skipped (the previous split reads it) and the
+ * last line is read to its end even if that is past offset + length. So splits can be cut at any byte and every
+ * line is still read exactly once.
+ * The file is mmap'd (read only, MADV_SEQUENTIAL) and records and tokens are string_views pointing straight into
+ * the mapping: nothing is allocated or copied per record. The views are valid until the InputSplit is destroyed,
+ * i.e. for the whole map call. */
+class InputSplit {
+public:
+    explicit InputSplit(const fileSplit &split);
+    ~InputSplit();
+    InputSplit(const InputSplit &) = delete;
+    InputSplit & operator=(const InputSplit &) = delete;
+    bool is_open() const { return open; }
+    bool next_record(std::string_view &record); // the next line (without '\n'); false once the split is done
+    bool next_token(std::string_view &token);   // the next whitespace separated word of our (remaining) lines
+                                                // (SIMD scan; after the first token next_record has no lines left)
+    const fileSplit & get_split() const { return split; }
+private:
+    fileSplit split;
+    char *map;              // start of the mapping (page aligned, at or before split.offset)
+    size_t mapLength;       // mapping runs to the end of the file since our last line may go past the split
+    const char *pos;        // start of the next line
+    const char *end;        // lines starting at or after end belong to the next split
+    const char *fileEnd;
+    const char *block;      // next_token scans the rest of our lines 64 bytes at a time: the current block,
+    const char *tokenEnd;   // where our last line ends
+    uint64_t spaces;        // and a bit per byte of block: whitespace, or already handed out
+    uint64_t block_mask() const;
+    bool open;
+};
+
+template<>
+struct Serializer<fileSplit> { // for shipping tasks from master: path (null terminated), offset, length
+    static size_t size(const fileSplit &s) { return s.fileName.size() + 1 + 2 * sizeof(long); }
+    static char * write(char *out, const fileSplit &s) {
+        memcpy(out, s.fileName.c_str(), s.fileName.size() + 1);
+        out += s.fileName.size() + 1;
+        out = Serializer<long>::write(out, s.offset);
+        return Serializer<long>::write(out, s.length);
+    }
+    static const char * read(const char *in, fileSplit &s) {
+        s.fileName.assign(in);
+        in += s.fileName.size() + 1;
+        in = Serializer<long>::read(in, s.offset);
+        return Serializer<long>::read(in, s.length);
+    }
+};
+
+} // namespace
+
+#endif //MAPREDUCECPP_INPUTSPLIT_H
@@ -3,20 +3,39 @@
 //
 
 #include "keyvalue.h"
+#include <algorithm>
+#include <cstdint>
+#include <unistd.h>
 
 namespace MAPREDUCE_NAMESPACE {
 
     template<class Key, class Value>
-    KeyValue<Key, Value>::KeyValue() {
-        kvmap = new std::map<Key, valueVector>;
-        finalMap = new std::map<Key, Value>;
+    KeyValue<Key, Value>::KeyValue(combineFunction f) : combiner(f), valueBytes(0), memoryBudget(0), added(0) {
+        kvmap = new kvMap;
+        finalMap = new finalMapType;
     }
 
 
     template<class Key, class Value>
     void KeyValue<Key, Value>::add_kv(const Key &k, const Value &v) {
-        /* should be called by emit in mapreduce */
-        (*kvmap)[k].push_back(v);
+        /* should be called by emit in mapreduce. The key is stored (interned for strings) only the first time */
+        add_value(kvmap->find_or_insert(k, [this](const Key &key) { return keyStorage<Key>::store(arena, key); }), v);
+        added++;
+        maybe_spill();
+    }
+
+    template<class Key, class Value>
+    void KeyValue<Key, Value>::add_block(const storedKey &k, std::string_view block, uint32_t count) {
+        /* values of k as they come out of a run (or RunMerger). No spill check: the caller loads in batches */
+        valueVector &values = kvmap->find_or_insert(k, [this](const storedKey &key) {
+            return keyStorage<Key>::store(arena, key);
+        });
+        const char *pos = block.data();
+        Value v;
+        for (uint32_t i = 0; i < count; i++) {
+            pos = Serializer<Value>::read(pos, v);
+            add_value(values, v);
+        }
     }
 
     template<class Key, class Value>
@@ -26,12 +45,103 @@ namespace MAPREDUCE_NAMESPACE {
     }
 
 
+    template<class Key, class Value>
+    void KeyValue<Key, Value>::merge(KeyValue<Key, Value> &other) {
+        /* used by mapper to combine the thread local KeyValues once the threads are joined.
+         * We take over other's arena so its interned keys can be reused as they are */
+        arena.adopt(other.arena);
+        runs.insert(runs.end(), other.runs.begin(), other.runs.end());
+        other.runs.clear();
+        for (auto &kvpair : *other.kvmap) {
+            valueVector &values = kvmap->find_or_insert(kvpair.first, [](const storedKey &key) { return key; });
+            if (values.empty()) { // new here: the vector moves over as is, charge its values
+                values.swap(kvpair.second);
+                for (auto &v : values) valueBytes += Serializer<Value>::size(v);
+            } else {              // add_value charges only what it actually stores
+                for (auto &v : kvpair.second) add_value(values, v);
+            }
+        }
+        other.clear();
+        maybe_spill();
+    }
+
+    template<class Key, class Value>
+    void KeyValue<Key, Value>::take_result(std::vector<std::pair<Key, Value>> &out) {
+        if (out.empty()) {
+            finalMap->take_entries(out);
+        } else { // reducing in batches: keep what we have
+            for (auto &kvpair : *finalMap) out.push_back(std::move(kvpair));
+            finalMap->clear();
+        }
+    }
+
+    template<class Key, class Value>
+    size_t KeyValue<Key, Value>::bytes() const {
+        // each key costs its table entry plus roughly 1.25 index slots
+        return arena.bytes() + kvmap->size() * (sizeof(typename kvMap::value_type) + 10) + valueBytes;
+    }
+
+    template<class Key, class Value>
+    void KeyValue<Key, Value>::spill() {
+        /* sort the keys by their encoded bytes in the run order (any consistent order works for merging; the
+         * reducer gets them in sort_and_shuffle's order only if the runs are in it) and write them out */
+        if (kvmap->empty()) return;
+        std::vector<std::pair<std::string, valueVector *>> sorted;
+        sorted.reserve(kvmap->size());
+        for (auto &kvpair : *kvmap) {
+            std::string key(Serializer<storedKey>::size(kvpair.first), '\0');
+            Serializer<storedKey>::write(&key[0], kvpair.first);
+            sorted.emplace_back(std::move(key), &kvpair.second);
+        }
+        std::sort(sorted.begin(), sorted.end(),
+                  [this](const std::pair<std::string, valueVector *> &a, const std::pair<std::string, valueVector *> &b) {
+                      return run_less(order, a.first, b.first);
+                  });
+        RunWriter run(scratchDir);
+        std::string block;
+        for (auto &entry : sorted) {
+            block.clear();
+            for (auto &v : *entry.second) {
+                size_t pos = block.size();
+                block.resize(pos + Serializer<Value>::size(v));
+                Serializer<Value>::write(&block[pos], v);
+            }
+            run.add(entry.first, (uint32_t) entry.second->size(), block);
+        }
+        run.close();
+        runs.push_back(run.get_path());
+        clear();
+        if (runs.size() >= 2 * MERGE_FANIN) compact_runs(runs, scratchDir, MERGE_FANIN, order); // bound the files
+    }
+
+    template<class Key, class Value>
+    std::vector<std::string> KeyValue<Key, Value>::take_runs() {
+        std::vector<std::string> taken;
+        compact_runs(runs, scratchDir, MERGE_FANIN, order);
+        taken.swap(runs);
+        return taken;
+    }
+
+    template<class Key, class Value>
+    void KeyValue<Key, Value>::clear() {
+        kvmap->clear();
+        arena.clear();
+        valueBytes = 0;
+    }
+
+
     template<class Key, class Value>
     KeyValue<Key, Value>::~KeyValue() {
         delete kvmap;
         delete finalMap;
+        for (auto &run : runs) unlink(run.c_str()); // never merged
     }
 
     /* We have to define this so the linker won't complain ... */
     template class KeyValue<std::string, int>;
+    template class KeyValue<std::string, long>;
+    template class KeyValue<std::string, double>;
+    template class KeyValue<std::string, std::string>;
+    template class KeyValue<uint64_t, double>;
+    template class KeyValue<uint64_t, uint64_t>;
 }
\ No newline at end of file
@@ -5,26 +5,95 @@
 #ifndef MAPREDUCECPP_KEYVALUE_H
 #define MAPREDUCECPP_KEYVALUE_H
 
-#include <map>
+#include "flatmap.h"
+#include "arena.h"
+#include "serializer.h"
+#include "spill.h"
+
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
 
 namespace MAPREDUCE_NAMESPACE {
 
+template<class Key>
+struct keyStorage { // how KeyValue keeps intermediate keys: as they are...
+    typedef Key type;
+    template<class L> static Key store(Arena &, const L &k) { return Key(k); }
+};
+
+template<>
+struct keyStorage<std::string> { // ...except strings: interned once in the KeyValue's arena and kept as views
+    typedef std::string_view type;
+    static std::string_view store(Arena &arena, std::string_view k) { return arena.copy(k); }
+};
+
 template<class Key, class Value>
 class KeyValue {
 public:
     typedef std::vector<Value> valueVector;
-    KeyValue();
+    typedef typename keyStorage<Key>::type storedKey; // Key, or a string_view into arena for string keys
+    typedef FlatMap<storedKey, valueVector> kvMap;   // intermediate pairs: unordered, one entry per distinct key
+    typedef FlatMap<Key, Value> finalMapType;
+    typedef Value (*combineFunction)(const Value &, const Value &);
+    KeyValue(combineFunction combiner = NULL);
     ~KeyValue();
     void add_kv(const Key &k, const Value &v);
+    template<class K = Key> // string keys only: the key is copied only if it's not in the map yet
+    typename std::enable_if<std::is_same<K, std::string>::value>::type add_kv(std::string_view k, const Value &v) {
+        add_value(kvmap->find_or_insert(k, [this](std::string_view key) { return arena.copy(key); }), v);
+        added++;
+        maybe_spill();
+    }
+    void add_block(const storedKey &k, std::string_view block, uint32_t count); // count Serializer encoded values
     void add_kv_final(const Key &k, const Value&v);
-    typename std::map<Key, valueVector>::iterator begin() { return kvmap->begin();};
-    typename std::map<Key, valueVector>::iterator end() { return kvmap->end();};
-    std::map<Key,Value> get_result() const { return *finalMap;};
+    template<class K = Key> // string keys only: straight from the view the reduce iterator gives
+    typename std::enable_if<std::is_same<K, std::string>::value>::type add_kv_final(std::string_view k, const Value &v) {
+        finalMap->find_or_insert(k) = v;
+    }
+    void merge(KeyValue<Key, Value> &other);   // move all of other's intermediate pairs into this (other is left empty)
+    typename kvMap::iterator begin() { return kvmap->begin();};
+    typename kvMap::iterator end() { return kvmap->end();};
+    template<class Compare> void sort(Compare compare) { kvmap->sort(compare);}; // order the intermediate keys
+    void take_result(std::vector<std::pair<Key, Value>> &out);   // append the final pairs to out (unordered)
+    combineFunction get_combiner() const { return combiner;};
+    void set_combiner(combineFunction f) { combiner = f;};
+
+    /* SPILLING: with a memory budget, the in-memory pairs are written out as a sorted run (see spill.h) whenever
+     * they grow past it. Whoever consumes the pairs then merges the runs (RunMerger) instead of iterating. */
+    void set_spill(size_t budget, const std::string &dir) { memoryBudget = budget; scratchDir = dir;};
+    void set_order(const runOrder &less) { order = less;};   // how runs are sorted (default: encoded byte order)
+    const runOrder & get_order() const { return order;};     // for merging them
+    size_t bytes() const;                           // rough memory used by the in-memory pairs
+    size_t size() const { return kvmap->size();};   // distinct keys in memory
+    void spill();                                   // write the in-memory pairs as a sorted run and free them
+    bool has_runs() const { return !runs.empty();};
+    const std::vector<std::string> & get_runs() const { return runs;};
+    std::vector<std::string> take_runs();           // at most MERGE_FANIN of them, for a RunMerger
+    void clear();                                   // drop the in-memory pairs (and the arena)
+    long get_added() const { return added;};        // add_kv calls so far (clear doesn't reset it)
 private:
-    std::map<Key, valueVector>  *kvmap;
-    std::map<Key,Value>         *finalMap;   // this map is for outputting
+    kvMap                       *kvmap;
+    Arena                       arena;       // bytes of the interned string keys of kvmap, freed all at once
+    finalMapType                *finalMap;   // this map is for outputting
+    combineFunction             combiner;    // if set, each key keeps one running value instead of all of them
+    size_t                      valueBytes;  // encoded size of the values kept in kvmap
+    size_t                      memoryBudget;   // 0: never spill
+    std::string                 scratchDir;
+    std::vector<std::string>    runs;        // run files spilled so far
+    runOrder                    order;       // of the records in runs
+    long                        added;
+    void add_value(valueVector &values, const Value &v) {
+        if (combiner != NULL && !values.empty()) {
+            values[0] = combiner(values[0], v);
+        } else {
+            values.push_back(v);
+            valueBytes += Serializer<Value>::size(v);
+        }
+    }
+    void maybe_spill() { if (memoryBudget != 0 && bytes() > memoryBudget) spill();}
 };
 
 
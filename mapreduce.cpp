@@ -10,157 +10,771 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fstream>
+#include <sstream>
+#include <functional>
+#include <algorithm>
+#include <climits>
+#include <queue>
+#include <random>
 
 
 namespace MAPREDUCE_NAMESPACE {
 
     template<class Key, class Value>
     MapReduce<Key, Value>::MapReduce(MPI_Comm communicator, char *inpath, char *outpath)
-            : comm(communicator), inputPath(inpath), outputPath(outpath) {
-        int name_len;
+            : inputPath(inpath), outputPath(outpath), splitSize(SPLIT_SIZE), distribution(DYNAMIC_DISTRIBUTION),
+              numThreads(MAXTHREADS), memoryBudget(0), keyCompare(NULL), rangePartitioned(false),
+              output(PARTITIONED_OUTPUT), reduction(SHUFFLE_REDUCE), shuffleTopology(FLAT_SHUFFLE),
+              nodeComm(MPI_COMM_NULL), leaderComm(MPI_COMM_NULL), streamSize(0), streamed(NULL), progressInterval(0),
+              progressOut(stderr), progressRequest(MPI_REQUEST_NULL), comm(communicator) {
+        int name_len, status;
         keyValue = new KeyValue<Key, Value>;
+        status = pthread_key_create(&kvKey, NULL);
+        if (status != 0) err_abort(status, "Create kvKey");
+        status = pthread_key_create(&counterKey, NULL);
+        if (status != 0) err_abort(status, "Create counterKey");
+        status = pthread_mutex_init(&outboxMutex, NULL);
+        if (status != 0) err_abort(status, "Init outbox mutex");
         MPI_Comm_rank(comm, &nrank);
         MPI_Comm_size(comm, &world_size);
         setup_machine_specifics();
         processor_name = new char[name_max];
         MPI_Get_processor_name(processor_name, &name_len);
         DPRINTF(("IN CONSTRUCTOR: Hello this is processor %s, nrank %d.\n", processor_name, nrank));
-        /* Send files of equal sizes to each node to prepare for mapping */
-        distributeWork();
+        stats.set_trace(&trace);
+        /* Master finds out what there is to map. The files are handed out on demand during mapper() */
+        if (nrank == 0) {
+            JobStats::timer t(stats, DISTRIBUTE_PHASE);
+            scanInput();
+        }
     }
 
     template<class Key, class Value>
     MapReduce<Key, Value>::~MapReduce() {
         // deallocate stuff
+        trace.write();                   // if set_trace was called
         delete processor_name;
         delete keyValue;
+        pthread_key_delete(kvKey);
+        pthread_key_delete(counterKey);
+        pthread_mutex_destroy(&outboxMutex);
+        if (nodeComm != MPI_COMM_NULL) MPI_Comm_free(&nodeComm);
+        if (leaderComm != MPI_COMM_NULL) MPI_Comm_free(&leaderComm);
     }
 
     template<class Key, class Value>
     void MapReduce<Key, Value>::distributeWork() {
-        if (nrank == 0) {
-            /* Setup job... open argv[1] (original dir), obtain paths of containing files */
-            masterSendPath();
-            // receive til finish
+        /* Work is pulled rather than dealt out up front: a rank asks for more only when its inbox runs low,
+         * so slow nodes and huge files no longer hold up everybody else */
+        if (distribution == STATIC_DISTRIBUTION) {
+            distributeTask();
+        } else if (nrank == 0) {
+            serveWork();
         } else { // slave
-            receiveWork();
+            requestWork();
         }
+        noMoreWork.store(true, std::memory_order_release);
     };
 
     template<class Key, class Value>
-    void *MapReduce<Key, Value>::engine(void *f) {
-        // distribute task and then run mapper on function f
-        std::string temp;
-        while (1) { // while not empty
-            pthread_mutex_lock(&countLock);
-            if (workqueue.empty()) {
-                pthread_mutex_unlock(&countLock);
-                break;
+    void *MapReduce<Key, Value>::engine_entry(void *arg) {
+        engineArgs *args = (engineArgs *) arg;
+        return args->mr->engine(arg);
+    }
+
+    template<class Key, class Value>
+    bool MapReduce<Key, Value>::next_task(int id, const fileSplit *&task) {
+        int threads = (int) deques.size() - 1;
+        WorkDeque<const fileSplit *> *inbox = deques.back();
+        while (1) {
+            bool finished = noMoreWork.load(std::memory_order_acquire); // read before looking so we never miss a task
+            if (deques[id]->pop(task)) return true;
+            /* our deque is dry: take a task and our share of the rest of the inbox into our own deque (only its owner
+             * may push), so the threads go back to popping without a CAS instead of all stealing from the inbox */
+            if (inbox->steal(task)) {
+                const fileSplit *more;
+                for (long share = inbox->size() / threads; share > 0 && inbox->steal(more); share--)
+                    deques[id]->push(more);
+                return true;
+            }
+            // the inbox is dry too: steal the oldest task of the next thread that still has some
+            for (int i = 1; i < threads; i++) {
+                if (deques[(id + i) % threads]->steal(task)) return true;
+            }
+            if (finished) return false;
+            usleep(POLL_USEC); // distributeWork is still waiting on master for more
+        }
+    }
+
+    template<class Key, class Value>
+    void *MapReduce<Key, Value>::engine(void *arg) {
+        // run the map function on our own tasks and then on the ones we can steal until there is no more work
+        engineArgs *args = (engineArgs *) arg;
+        pthread_setspecific(kvKey, args->localKV); // emit from this thread goes to its own KeyValue
+        pthread_setspecific(counterKey, &args->counters);
+        const fileSplit *task;
+        while (next_task(args->id, task)) {
+            Trace::span traced(trace, args->events, "map task", args->id + 1);
+            traced.arg("path", task->fileName).arg("offset", task->offset).arg("bytes", task->length);
+            args->bytesRead += task->length;
+            if (args->f != NULL) {
+                args->f(this, task->fileName.c_str());
+            } else {
+                InputSplit split(*task);
+                if (!split.is_open())
+                    fprintf(stderr, "ERROR (Processor %s rank %d): Cannot open file %s\n", processor_name, nrank,
+                            task->fileName.c_str());
+                else
+                    args->sf(this, split);
             }
-            temp = workqueue.front();
-            workqueue.pop();
-            pthread_mutex_unlock(&countLock);
-            // cast the function passed to engine back to the function and run
-            ((void (*)(MapReduce<Key, Value> *, const char *)) f)(this, temp.c_str());
+            KeyValue<Key, Value> *kv = args->localKV;
+            if (streamSize > 0 && kv->bytes() > streamSize && !kv->has_runs()) streamOut(*kv);
+            bytesMapped.fetch_add(task->length, std::memory_order_relaxed); // for progress reports
+            tasksMapped.fetch_add(1, std::memory_order_relaxed);
         }
+        runningThreads--;
+        return NULL;
     };
 
 
     template<class Key, class Value>
     void MapReduce<Key, Value>::mapper(void (*f)(MapReduce<Key, Value> *, const char *)) {
-//        /* We use threads to further parallize */
-//        DPRINTF((" @@IN MAP: Processor %s, nrank %d: workqueue %s\n ", processor_name, nrank, workqueue.front().c_str()));
-//        int status, numthreads;
-//        int worksize = workqueue.size();
-//        status = pthread_mutex_init(&countLock, nullptr);
-//        if (status != 0) err_abort(status, "Initialize countLock in start \n");
-//        numthreads = worksize < MAXTHREADS ? worksize : MAXTHREADS;
-//        pthread_t * threads = new pthread_t[numthreads];
-//        for (int i = 0; i < numthreads; i++) {
-//            status = pthread_create(&threads[i], NULL, MapReduce<Key,Value>::engine, f);
-//            if (status != 0) err_abort(status, "Create worker");
-//        }
-//        for (int i = 0; i < numthreads; i++) {
-//            status = pthread_join(threads[i], NULL);
-//            if (status != 0) err_abort(status, "Joining workers");
-//        }
-//        delete threads;
-        std::string temp;
-        while (1) { // while not empty
-            if (workqueue.empty()) {
-                break;
+        if (nrank == 0) { // f reads the whole file itself
+            JobStats::timer t(stats, DISTRIBUTE_PHASE);
+            makeSplits(0);
+        }
+        run_map(f, NULL);
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::mapper(void (*f)(MapReduce<Key, Value> *, InputSplit &)) {
+        if (nrank == 0) {
+            JobStats::timer t(stats, DISTRIBUTE_PHASE);
+            makeSplits(splitSize);
+        }
+        run_map(NULL, f);
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::run_map(mapFunction f, splitMapFunction sf) {
+        /* We use threads to further parallize. The main thread keeps feeding them through the inbox deque */
+        int status, numthreads = numThreads;
+        DPRINTF(("Processor %s, nrank %d: mapping with %d threads\n", processor_name, nrank, numthreads));
+        pthread_t *threads = new pthread_t[numthreads];
+        engineArgs *args = new engineArgs[numthreads];
+        {
+            JobStats::timer t(stats, MAP_PHASE);
+            noMoreWork.store(false);
+            bytesMapped.store(0);
+            tasksMapped.store(0);
+            progressStart = lastProgress = MPI_Wtime();
+            rankBytes.assign(world_size, 0);
+            rankTasks.assign(world_size, 0);
+            finalReports = 0;
+            for (int i = 0; i <= numthreads; i++) // the extra one is the inbox, owned by the main thread
+                deques.push_back(new WorkDeque<const fileSplit *>());
+            runningThreads.store(numthreads);
+            if (streamSize > 0) {
+                streamed = new KeyValue<Key, Value>(keyValue->get_combiner());
+                streamed->set_spill(memoryBudget, scratchDir);
+                sentTo.assign(world_size, 0);
+                receivedFrom.assign(world_size, 0);
+            }
+            for (int i = 0; i < numthreads; i++) {
+                args[i].mr = this;
+                args[i].id = i;
+                args[i].f = f;
+                args[i].sf = sf;
+                args[i].bytesRead = 0;
+                args[i].localKV = new KeyValue<Key, Value>(keyValue->get_combiner());
+                args[i].localKV->set_spill(memoryBudget / numthreads, scratchDir); // the threads share the budget
+                status = pthread_create(&threads[i], NULL, MapReduce<Key, Value>::engine_entry, &args[i]);
+                if (status != 0) err_abort(status, "Create worker");
+            }
+            distributeWork(); // returns once every task for this rank is queued
+            while ((streamSize > 0 || progressInterval > 0) && runningThreads.load() > 0) {
+                if (streamSize > 0) pumpStream(); // keep the streamed pairs moving till the end
+                progress();
+                usleep(POLL_USEC);
+            }
+            for (int i = 0; i < numthreads; i++) {
+                status = pthread_join(threads[i], NULL);
+                if (status != 0) err_abort(status, "Joining workers");
             }
-            temp = workqueue.front();
-            workqueue.pop();
-            // cast the function passed to engine back to the function and run
-            f(this, temp.c_str());
+            finishProgress();
         }
+        {
+            // every thread is done so the thread local pairs can be moved into keyValue without locking
+            JobStats::timer t(stats, COMBINE_PHASE);
+            for (int i = 0; i < numthreads; i++) {
+                stats.add(BYTES_READ, args[i].bytesRead);
+                stats.add(PAIRS_EMITTED, args[i].localKV->get_added());
+                stats.merge(args[i].counters);
+                trace.merge(args[i].events);
+                keyValue->merge(*args[i].localKV);
+                delete args[i].localKV;
+            }
+        }
+        if (streamSize > 0) {
+            {
+                JobStats::timer t(stats, SHUFFLE_PHASE);
+                finishStream();
+            }
+            JobStats::timer t(stats, COMBINE_PHASE);
+            keyValue->merge(*streamed);
+            delete streamed;
+            streamed = NULL;
+        }
+        delete[] threads;
+        delete[] args;
+        for (auto d : deques) delete d;
+        deques.clear();
+        stats.reduce_counters(comm); // end of the map: the ranks' user counters are summed on master
+        DPRINTF(("Processor %s, nrank %d: mapped %d splits\n", processor_name, nrank, (int) tasks.size()));
+        tasks.clear();
     }
 
 
     template<class Key, class Value>
-    void MapReduce<Key, Value>::reduceCommunication() { /* reducer uses this to send result from slaves to master */
-        MPI_Datatype kvtype = register_kv_type();
+    void MapReduce<Key, Value>::streamOut(KeyValue<Key, Value> &kv) {
+        std::vector<std::vector<char>> packages(world_size);
+        for (auto &kvpair : kv) {
+            std::vector<char> &package = packages[owner(kvpair.first)];
+            for (auto &v : kvpair.second)
+                pack_kv(package, kvpair.first, v);
+        }
+        kv.clear();
+        pthread_mutex_lock(&outboxMutex);
+        for (int d = 0; d < world_size; d++)
+            if (!packages[d].empty()) outbox.emplace_back(d, std::move(packages[d]));
+        pthread_mutex_unlock(&outboxMutex);
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::pumpStream() {
+        /* only the main thread talks MPI: it sends what the map threads queued, receives whatever streamed
+         * messages have shown up and folds the completed ones into streamed */
+        std::deque<std::pair<int, std::vector<char>>> ready;
+        pthread_mutex_lock(&outboxMutex);
+        ready.swap(outbox);
+        pthread_mutex_unlock(&outboxMutex);
+        typename KeyValue<Key, Value>::storedKey k;
+        Value v;
+        for (auto &package : ready) {
+            if (package.first == nrank) { // ours already
+                const char *pos = package.second.data(), *last = pos + package.second.size();
+                while (pos < last) {
+                    pos = unpack_kv(pos, k, v);
+                    streamed->add_kv(k, v);
+                }
+                continue;
+            }
+            sendBuffers.push_back(std::move(package.second));
+            sendRequests.push_back(MPI_REQUEST_NULL);
+            MPI_Isend(sendBuffers.back().data(), (int) sendBuffers.back().size(), MPI_BYTE, package.first,
+                      STREAM_TAG, comm, &sendRequests.back());
+            std::string args;
+            if (trace.enabled()) { // the async event spans from the Isend to its completion
+                json_arg(args, "to", package.first);
+                json_arg(args, "bytes", (long) sendBuffers.back().size());
+            }
+            sendTraces.push_back(trace.begin_async("stream send", args));
+            stats.add(BYTES_SENT, (long) sendBuffers.back().size());
+            sentTo[package.first]++;
+        }
+        while (1) { // post a receive for every message that has arrived (or is arriving)
+            int flag, len;
+            MPI_Status status;
+            MPI_Iprobe(MPI_ANY_SOURCE, STREAM_TAG, comm, &flag, &status);
+            if (!flag) break;
+            MPI_Get_count(&status, MPI_BYTE, &len);
+            recvBuffers.emplace_back(len);
+            recvRequests.push_back(MPI_REQUEST_NULL);
+            MPI_Irecv(recvBuffers.back().data(), len, MPI_BYTE, status.MPI_SOURCE, STREAM_TAG, comm,
+                      &recvRequests.back());
+            std::string args;
+            if (trace.enabled()) {
+                json_arg(args, "from", status.MPI_SOURCE);
+                json_arg(args, "bytes", len);
+            }
+            recvTraces.push_back(trace.begin_async("stream receive", args));
+            receivedFrom[status.MPI_SOURCE]++;
+            stats.add(BYTES_RECEIVED, len);
+        }
+        int done;
+        std::vector<int> indices(std::max(sendRequests.size(), recvRequests.size()));
+        if (!recvRequests.empty()) {
+            MPI_Testsome((int) recvRequests.size(), recvRequests.data(), &done, indices.data(), MPI_STATUSES_IGNORE);
+            for (int i = 0; i < done && done != MPI_UNDEFINED; i++) {
+                trace.end_async("stream receive", recvTraces[indices[i]]);
+                std::vector<char> &buf = recvBuffers[indices[i]];
+                const char *pos = buf.data(), *last = buf.data() + buf.size();
+                while (pos < last) {
+                    pos = unpack_kv(pos, k, v);
+                    streamed->add_kv(k, v);
+                }
+                std::vector<char>().swap(buf);
+            }
+        }
+        if (!sendRequests.empty()) {
+            MPI_Testsome((int) sendRequests.size(), sendRequests.data(), &done, indices.data(), MPI_STATUSES_IGNORE);
+            for (int i = 0; i < done && done != MPI_UNDEFINED; i++) {
+                trace.end_async("stream send", sendTraces[indices[i]]);
+                std::vector<char>().swap(sendBuffers[indices[i]]);
+            }
+        }
+        // drop the finished requests (Testsome set them to MPI_REQUEST_NULL) from the front
+        while (!recvRequests.empty() && recvRequests.front() == MPI_REQUEST_NULL) {
+            recvRequests.erase(recvRequests.begin());
+            recvBuffers.erase(recvBuffers.begin());
+            recvTraces.erase(recvTraces.begin());
+        }
+        while (!sendRequests.empty() && sendRequests.front() == MPI_REQUEST_NULL) {
+            sendRequests.erase(sendRequests.begin());
+            sendBuffers.erase(sendBuffers.begin());
+            sendTraces.erase(sendTraces.begin());
+        }
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::finishStream() {
+        /* the map threads are done: tell every rank how many messages we sent it and keep pumping until we
+         * have received as many as were sent to us */
+        std::vector<int> expected(world_size);
+        pumpStream(); // whatever the threads queued last
+        MPI_Alltoall(sentTo.data(), 1, MPI_INT, expected.data(), 1, MPI_INT, comm);
+        while (expected != receivedFrom || !recvRequests.empty() || !sendRequests.empty()) {
+            pumpStream();
+            usleep(POLL_USEC);
+        }
+        long messages = 0;
+        for (int n : receivedFrom) messages += n;
+        DPRINTF(("Processor %s, nrank %d: received %ld streamed messages while mapping\n", processor_name, nrank,
+                messages));
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::progress() {
+        if (progressInterval <= 0) return;
+        double now = MPI_Wtime();
+        if (now - lastProgress < progressInterval) return;
+        lastProgress = now;
         if (nrank == 0) {
-            MPI_Status status, status2;
-            /* FIRST COLLECT PACKAGES FROM SLAVES ...  */
-            kv *collect[world_size - 1];     // array to store results from slaves
-            int collectsize[world_size - 1]; // to remember the size of the kv from
-            int packagesize;                // size of receiving package (the kv pairs that slaves send below)
-            for (int i = 0; i < world_size - 1; i++) { // -1 because we are not doing anything
-                MPI_Probe(MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status); // PROBE to get package size
-                MPI_Get_count(&status, kvtype, &packagesize);
-                collect[i] = new kv[packagesize]; // remember to free after done counting and adding to result !!!!
-                collectsize[i] = packagesize;
-                MPI_Recv(collect[i], packagesize, kvtype, status.MPI_SOURCE, 0, MPI_COMM_WORLD, &status2);
-            }
-            // now collect has a bunch of kv arrays. we add each on result (can parallelize with threads)
-            for (int i = 0; i < world_size - 1; i++) {
-                for (int j = 0; j < collectsize[i]; j++) {
-                    kv temp = collect[i][j];
-                    // Here master's keyValue get slaves' new values !!! IMPORTANT!!!
-                    keyValue->add_kv(temp.key,
-                                     temp.value); // this add to the (Key, Vector<Value>) pair for final reduction
+            collectProgress();
+            printProgress(false);
+            return;
+        }
+        int sent;
+        MPI_Test(&progressRequest, &sent, MPI_STATUS_IGNORE); // (true for MPI_REQUEST_NULL)
+        if (!sent) return; // master has not taken the last one yet: skip a round rather than pile them up
+        progressMessage[0] = bytesMapped.load(std::memory_order_relaxed);
+        progressMessage[1] = tasksMapped.load(std::memory_order_relaxed);
+        progressMessage[2] = 0;
+        MPI_Isend(progressMessage, 3, MPI_LONG, 0, PROGRESS_TAG, comm, &progressRequest);
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::collectProgress() {
+        while (1) {
+            int flag;
+            long message[3];
+            MPI_Status status;
+            MPI_Iprobe(MPI_ANY_SOURCE, PROGRESS_TAG, comm, &flag, &status);
+            if (!flag) break;
+            MPI_Recv(message, 3, MPI_LONG, status.MPI_SOURCE, PROGRESS_TAG, comm, MPI_STATUS_IGNORE);
+            rankBytes[status.MPI_SOURCE] = message[0]; // messages from a rank arrive in order: this is its latest
+            rankTasks[status.MPI_SOURCE] = message[1];
+            finalReports += (int) message[2];
+        }
+        rankBytes[0] = bytesMapped.load(std::memory_order_relaxed);
+        rankTasks[0] = tasksMapped.load(std::memory_order_relaxed);
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::printProgress(bool done) {
+        /* on a terminal the line is redrawn in place, in a log file every report is a line of its own */
+        double elapsed = MPI_Wtime() - progressStart, mb = 1024.0 * 1024.0;
+        long bytes = 0, tasksDone = 0;
+        int slowest = 0;
+        for (int r = 0; r < world_size; r++) {
+            bytes += rankBytes[r];
+            tasksDone += rankTasks[r];
+            if (rankBytes[r] < rankBytes[slowest]) slowest = r;
+        }
+        double rate = elapsed > 0 ? bytes / elapsed : 0;
+        char eta[32];
+        if (done) snprintf(eta, sizeof(eta), "done in %.1fs", elapsed);
+        else if (rate > 0) snprintf(eta, sizeof(eta), "ETA %.0fs", (totalBytes - bytes) / rate);
+        else snprintf(eta, sizeof(eta), "ETA ?");
+        bool live = isatty(fileno(progressOut));
+        fprintf(progressOut, "%smap %3.0f%%  %.1f/%.1f MB  %.1f MB/s  %s  %ld/%ld tasks  slowest rank %d (%.1f MB/s)%s",
+                live ? "\r" : "", totalBytes > 0 ? 100.0 * bytes / totalBytes : 100.0, bytes / mb, totalBytes / mb,
+                rate / mb, eta, tasksDone, totalTasks, slowest, elapsed > 0 ? rankBytes[slowest] / elapsed / mb : 0,
+                live ? "\033[K" : "\n");
+        if (live && done) fputc('\n', progressOut);
+        fflush(progressOut);
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::finishProgress() {
+        /* every slave's last report says it's done, so master's final line has everybody's numbers */
+        if (progressInterval <= 0) return;
+        if (nrank != 0) {
+            MPI_Wait(&progressRequest, MPI_STATUS_IGNORE);
+            progressMessage[0] = bytesMapped.load();
+            progressMessage[1] = tasksMapped.load();
+            progressMessage[2] = 1;
+            MPI_Send(progressMessage, 3, MPI_LONG, 0, PROGRESS_TAG, comm);
+            return;
+        }
+        while (1) {
+            collectProgress();
+            if (finalReports == world_size - 1) break;
+            if (streamSize > 0) pumpStream();
+            progress();
+            usleep(POLL_USEC);
+        }
+        printProgress(true);
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::shuffle() { /* every rank sends each key to the rank that owns its hash bucket */
+        typedef typename KeyValue<Key, Value>::storedKey storedKey;
+        typename KeyValue<Key, Value>::combineFunction combiner = keyValue->get_combiner();
+        KeyValue<Key, Value> *received = new KeyValue<Key, Value>(combiner); // combine what we receive too
+        received->set_spill(memoryBudget, scratchDir);
+        if (rangePartitioned) received->set_order(keyOrder()); // so reduce_runs merges our range back in order
+        /* Spilled pairs are read back through a merge of the runs (the rest of memory is spilled first so every key
+         * comes out once). The exchange goes in rounds: a round ends when a pair would take a package past peerBytes
+         * (the pair is carried over to the next round), so every count and both totals of the alltoallv (ints) stay
+         * under INT_MAX. A node leader sends and receives for all the ranks of its node, so the node aware exchange
+         * divides the cap by the ranks per node and leaves room for its chunk headers. With a budget peerBytes is
+         * also a quarter of it split among the destinations: every rank then sends and receives at most a quarter
+         * of the budget per round. A key's values may span rounds */
+        RunMerger *merger = NULL;
+        if (keyValue->has_runs()) {
+            keyValue->spill();
+            merger = new RunMerger(keyValue->take_runs(), keyValue->get_order());
+        }
+        size_t peerBytes = INT_MAX / world_size;
+        if (shuffleTopology == NODE_AWARE_SHUFFLE) {
+            setupNodes();
+            peerBytes = INT_MAX / ((size_t) world_size * maxLocalSize) - sizeof(int) - sizeof(uint64_t);
+        }
+        if (memoryBudget > 0) peerBytes = std::min(peerBytes, memoryBudget / 4 / world_size);
+        std::vector<std::vector<char>> packages(world_size);
+        std::vector<char> carry, recvbuf;
+        int carryTo = 0;
+        auto fits = [&](int d, size_t before) { // else move the pair just packed for d into carry
+            std::vector<char> &package = packages[d];
+            if (package.size() <= peerBytes || before == 0) return true;
+            carry.assign(package.begin() + before, package.end());
+            carryTo = d;
+            package.resize(before);
+            return false;
+        };
+        auto inmemory = keyValue->begin();
+        storedKey groupKey;         // the merged group's key
+        Value value, folded;
+        size_t at = 0, b = 0;       // next value of the in-memory key / next block of the merged group
+        uint32_t i = 0;             // next value in block b, read from next
+        const char *next = NULL;
+        bool more = true, full;
+        while (1) {
+            /* FIRST PACK OUR INTERMEDIATE PAIRS INTO world_size BUCKETS (see owner) */
+            packages[carryTo].swap(carry);
+            carry.clear();
+            full = false;
+            while (more && !full) {
+                if (merger == NULL) {
+                    if (!(more = inmemory != keyValue->end())) break;
+                    int d = owner(inmemory->first);
+                    while (!full && at < inmemory->second.size()) {
+                        size_t before = packages[d].size();
+                        pack_kv(packages[d], inmemory->first, inmemory->second[at++]);
+                        full = !fits(d, before);
+                    }
+                    if (at == inmemory->second.size()) {
+                        ++inmemory;
+                        at = 0;
+                    }
+                } else {
+                    if (b == merger->blocks()) {
+                        if (!(more = merger->next_group())) break;
+                        Serializer<storedKey>::read(merger->key().data(), groupKey);
+                        b = i = 0;
+                    }
+                    int d = owner(groupKey);
+                    while (!full && b < merger->blocks()) { // one block per run that has groupKey
+                        if (i == 0) next = merger->block(b).data();
+                        next = Serializer<Value>::read(next, value);
+                        if (combiner != NULL) folded = b == 0 && i == 0 ? value : combiner(folded, value);
+                        if (++i == merger->count(b)) {
+                            b++;
+                            i = 0;
+                        }
+                        if (combiner == NULL) {
+                            size_t before = packages[d].size();
+                            pack_kv(packages[d], groupKey, value);
+                            full = !fits(d, before);
+                        }
+                    }
+                    if (combiner != NULL) {
+                        size_t before = packages[d].size();
+                        pack_kv(packages[d], groupKey, folded);
+                        full = !fits(d, before);
+                    }
                 }
-                // now we are done with that collect
-                delete[] collect[i];
             }
-        } else { // send pairs of data --> master gather these pairs and process
-            /* PACKAGE THE MAP AND THEN SEND IT TO MASTER */
-            long size = result.size();
-            kv *package = new kv[size];
-            int i = 0;
-            for (auto resultkv : result) {
-                strcpy(package[i].key, resultkv.first.c_str());
-                package[i++].value = resultkv.second;
+            long outgoing = 0, own = (long) packages[nrank].size();
+            for (auto &package : packages) outgoing += (long) package.size();
+            if (shuffleTopology == NODE_AWARE_SHUFFLE)
+                exchangeByNode(packages, recvbuf);
+            else
+                exchange(packages, recvbuf, comm);
+            stats.add(BYTES_SENT, outgoing - own);
+            stats.add(BYTES_RECEIVED, (long) recvbuf.size() - own);
+            for (auto &package : packages) package.clear();
+            /* NOW KEEP THE PAIRS FOR OUR OWN KEY RANGE */
+            storedKey k;    // string keys are views into recvbuf, interned by add_kv only if new
+            Value v;
+            const char *pos = recvbuf.data(), *last = recvbuf.data() + recvbuf.size();
+            while (pos < last) {
+                pos = unpack_kv(pos, k, v);
+                received->add_kv(k, v);
             }
-            MPI_Send(package, size, kvtype, 0, 0, MPI_COMM_WORLD);
-            delete[] package;
+            int mine = more, anyone;
+            MPI_Allreduce(&mine, &anyone, 1, MPI_INT, MPI_MAX, comm); // the exchange is collective: go on together
+            if (!anyone) break;
         }
-        // FREE TYPE
-        MPI_Type_free(&kvtype);
+        delete merger;
+        delete keyValue;
+        keyValue = received;
+    }
+
+    template<class Key, class Value>
+    template<class K>
+    int MapReduce<Key, Value>::owner(const K &k) {
+        if (!rangePartitioned) // std::hash<std::string_view> agrees with std::hash<std::string>
+            return (int) (std::hash<K>()(k) % world_size);
+        // the first splitter that k goes before is its rank's upper bound (keys equal to it go to the next rank)
+        Key key(k);
+        return (int) (std::upper_bound(splitters.begin(), splitters.end(), key,
+                                       [this](const Key &a, const Key &b) { return key_less(a, b); })
+                      - splitters.begin());
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::sampleKeys(std::vector<char> &sample) {
+        /* reservoir sampling over our distinct keys, in memory and in the spilled runs (read, not merged) */
+        typedef typename KeyValue<Key, Value>::storedKey storedKey;
+        std::vector<Key> picked;
+        std::mt19937_64 random((uint64_t) nrank + 1);
+        long seen = 0;
+        auto offer = [&](const storedKey &k) {
+            if (picked.size() < SORT_SAMPLES) {
+                picked.push_back(Key(k));
+            } else {
+                long slot = (long) (random() % (uint64_t) (seen + 1));
+                if (slot < SORT_SAMPLES) picked[slot] = Key(k);
+            }
+            seen++;
+        };
+        for (auto &kvpair : *keyValue) offer(kvpair.first);
+        for (auto &path : keyValue->get_runs()) {
+            RunReader run(path);
+            while (run.next()) {
+                storedKey k;
+                Serializer<storedKey>::read(run.key().data(), k);
+                offer(k);
+            }
+        }
+        for (auto &k : picked) {
+            size_t pos = sample.size();
+            sample.resize(pos + Serializer<Key>::size(k));
+            Serializer<Key>::write(&sample[pos], k);
+        }
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::pickSplitters() {
+        /* every rank gets every sample and picks the same splitters: evenly spaced in the sorted samples */
+        std::vector<char> sample, all;
+        sampleKeys(sample);
+        int size = (int) sample.size(), total = 0;
+        std::vector<int> counts(world_size), displs(world_size);
+        MPI_Allgather(&size, 1, MPI_INT, counts.data(), 1, MPI_INT, comm);
+        for (int i = 0; i < world_size; i++) {
+            displs[i] = total;
+            total += counts[i];
+        }
+        all.resize(total);
+        MPI_Allgatherv(sample.data(), size, MPI_BYTE, all.data(), counts.data(), displs.data(), MPI_BYTE, comm);
+        std::vector<Key> samples;
+        Key k;
+        const char *pos = all.data(), *last = all.data() + all.size();
+        while (pos < last) {
+            pos = Serializer<Key>::read(pos, k);
+            samples.push_back(k);
+        }
+        std::sort(samples.begin(), samples.end(), [this](const Key &a, const Key &b) { return key_less(a, b); });
+        splitters.clear();
+        if (!samples.empty())
+            for (int i = 1; i < world_size; i++)
+                splitters.push_back(samples[(size_t) i * samples.size() / world_size]);
+        DPRINTF(("Processor %s, nrank %d: %d sort samples\n", processor_name, nrank, (int) samples.size()));
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::sortKeys() {
+        typedef typename KeyValue<Key, Value>::storedKey storedKey;
+        if (keyCompare == NULL) // storedKey orders like Key (string_view like string): no copies
+            keyValue->sort([](const storedKey &a, const storedKey &b) { return a < b; });
+        else
+            keyValue->sort([this](const storedKey &a, const storedKey &b) { return keyCompare(Key(a), Key(b)); });
+    }
+
+    template<class Key, class Value>
+    runOrder MapReduce<Key, Value>::keyOrder() {
+        typedef typename KeyValue<Key, Value>::storedKey storedKey;
+        return [this](std::string_view a, std::string_view b) {
+            storedKey ka, kb;
+            Serializer<storedKey>::read(a.data(), ka);
+            Serializer<storedKey>::read(b.data(), kb);
+            return keyCompare == NULL ? ka < kb : keyCompare(Key(ka), Key(kb)); // like sortKeys
+        };
     }
 
     template<class Key, class Value>
     void MapReduce<Key, Value>::reducer(void (*f)(MapReduce<Key, Value> *)) {
-        if (nrank != 0) {// first we reduce locally on slave nodes
-            f(this); // hopefully call emit_final and we have a finished keyValue object.
-            result = keyValue->get_result(); // so now each node will have the local result to send to master
+        bool tree = reduction == TREE_REDUCE && !rangePartitioned; // keys partitioned by range are already disjoint
+        if (tree && keyValue->get_combiner() == NULL) {
+            if (nrank == 0) fprintf(stderr, "ERROR: TREE_REDUCE needs a combiner (see set_combiner)\n");
+            MPI_Abort(comm, 1);
         }
-        // the function below will send slaves' data to master
-        reduceCommunication(); // master's kv will receive new kv values
-        if (nrank == 0) {
-            f(this); // now we emit final in master's node and have a finished master's keyValue object which is our final result
-            result = keyValue->get_result(); // this is master's result
-            write_to_file();                   // write result map to file specified by output path
+        // exchange pairs so that every occurrence of a key lands on the same rank
+        if (!tree && !rangePartitioned) { // else sort_and_shuffle did it
+            JobStats::timer t(stats, SHUFFLE_PHASE);
+            shuffle();
+        }
+        {
+            JobStats::timer t(stats, REDUCE_PHASE);
+            if (keyValue->has_runs()) {
+                reduce_runs(f);          // our key range did not fit in the memory budget
+            } else {
+                Trace::span traced(trace, "reduce function");
+                traced.arg("keys", (long) keyValue->size());
+                f(this);                 // each rank reduces its own key range in parallel
+                keyValue->take_result(result);   // so now each node will have the local result for its key range
+            }
+        }
+        if (tree) {                      // partial results of overlapping keys: fold them together on master
+            JobStats::timer t(stats, SHUFFLE_PHASE);
+            treeReduce();
+        }
+        if (!tree || nrank == 0 || output == SINGLE_FILE_OUTPUT) { // (the shared file is written collectively)
+            JobStats::timer t(stats, WRITE_PHASE);
+            write_to_file();             // every rank writes its own partition (see outputMode)
         }
+        stats.reduce_counters(comm);     // counters the reduce function bumped
+    }
 
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::treeReduce() {
+        /* binomial tree: in round r (step = 2^r) the ranks that have bit r set send their sorted result to
+         * nrank - step and drop out, the others merge what they receive. Master has everything after the last round */
+        std::sort(result.begin(), result.end(), [this](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+            return key_less(a.first, b.first);
+        });
+        std::vector<char> partial;
+        for (int step = 1; step < world_size; step <<= 1) {
+            if (nrank & step) {
+                partial.clear();
+                for (auto &resultkv : result)
+                    pack_kv(partial, resultkv.first, resultkv.second);
+                Trace::span traced(trace, "tree send");
+                traced.arg("to", nrank - step).arg("bytes", (long) partial.size());
+                long long len = (long long) partial.size(); // the length, then pieces whose counts fit in an int
+                MPI_Send(&len, 1, MPI_LONG_LONG, nrank - step, REDUCE_TAG, comm);
+                for (long long at = 0; at < len; at += OUTPUT_PIECE)
+                    MPI_Send(partial.data() + at, (int) std::min(len - at, (long long) OUTPUT_PIECE), MPI_BYTE,
+                             nrank - step, REDUCE_TAG, comm);
+                stats.add(BYTES_SENT, (long) len);
+                result.clear();
+                break;
+            }
+            if (nrank + step < world_size) {
+                long long len;
+                Trace::span traced(trace, "tree receive"); // includes waiting for the sender
+                MPI_Recv(&len, 1, MPI_LONG_LONG, nrank + step, REDUCE_TAG, comm, MPI_STATUS_IGNORE);
+                partial.resize(len);
+                for (long long at = 0; at < len; at += OUTPUT_PIECE) // messages from one sender arrive in order
+                    MPI_Recv(partial.data() + at, (int) std::min(len - at, (long long) OUTPUT_PIECE), MPI_BYTE,
+                             nrank + step, REDUCE_TAG, comm, MPI_STATUS_IGNORE);
+                stats.add(BYTES_RECEIVED, (long) len);
+                traced.arg("from", nrank + step).arg("bytes", (long) len);
+                mergeResult(partial);
+            }
+        }
+        DPRINTF(("Processor %s, nrank %d: %d pairs after tree reduction\n", processor_name, nrank, (int) result.size()));
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::mergeResult(const std::vector<char> &partial) {
+        /* both sides are sorted: one merge pass, folding the values of keys found on both sides with the combiner */
+        typename KeyValue<Key, Value>::combineFunction combiner = keyValue->get_combiner();
+        std::vector<std::pair<Key, Value>> merged;
+        merged.reserve(result.size());
+        auto mine = result.begin();
+        std::pair<Key, Value> theirs;
+        const char *pos = partial.data(), *last = partial.data() + partial.size();
+        while (pos < last) {
+            pos = unpack_kv(pos, theirs.first, theirs.second);
+            while (mine != result.end() && key_less(mine->first, theirs.first))
+                merged.push_back(std::move(*mine++));
+            if (mine != result.end() && !key_less(theirs.first, mine->first)) { // same key
+                merged.emplace_back(std::move(mine->first), combiner(mine->second, theirs.second));
+                ++mine;
+            } else {
+                merged.push_back(std::move(theirs));
+            }
+        }
+        while (mine != result.end()) merged.push_back(std::move(*mine++));
+        result.swap(merged);
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::reduce_runs(void (*f)(MapReduce<Key, Value> *)) {
+        /* merge the runs back in key order and call f on whole keys, a memory budget's worth at a time. The FlatMap keeps
+         * insertion order so f iterates each batch in merge order, and the batches follow each other in it too */
+        typedef typename KeyValue<Key, Value>::storedKey storedKey;
+        keyValue->spill();
+        RunMerger merger(keyValue->take_runs(), keyValue->get_order()); // in key order after sort_and_shuffle
+        bool more = merger.next_group();
+        int batches = 0;
+        while (more) {
+            while (more && keyValue->bytes() < memoryBudget) {
+                storedKey k;
+                Serializer<storedKey>::read(merger.key().data(), k);
+                for (size_t b = 0; b < merger.blocks(); b++)
+                    keyValue->add_block(k, merger.block(b), merger.count(b));
+                more = merger.next_group();
+            }
+            Trace::span traced(trace, "reduce batch");
+            traced.arg("keys", (long) keyValue->size());
+            f(this);
+            keyValue->take_result(result);
+            keyValue->clear();
+            batches++;
+        }
+        DPRINTF(("Processor %s, nrank %d: reduced spilled pairs in %d batches\n", processor_name, nrank, batches));
     }
 
     template<class Key, class Value>
     void MapReduce<Key, Value>::emit(Key k, Value v) {
         // send the k, v pair to the KeyValue class and store them in a special way for collating and reducing later
-        keyValue->add_kv(k, v);
+        KeyValue<Key, Value> *kv = (KeyValue<Key, Value> *) pthread_getspecific(kvKey); // set by map threads
+        (kv != NULL ? kv : keyValue)->add_kv(k, v);
     }
 
     template<class Key, class Value>
@@ -170,9 +784,23 @@ namespace MAPREDUCE_NAMESPACE {
 
     template<class Key, class Value>
     void MapReduce<Key, Value>::sort_and_shuffle(bool (*compare)(Key, Key)) {
-        // to do
-        if (compare == NULL) DPRINTF(("Debug: in sort_and shuffle NULL\n"));
+        /* sample sort: pick splitters from a sample of every rank's keys, send each key to the rank owning its
+         * range, then every rank sorts its own keys. Concatenating the ranks' partitions gives the global order */
+        JobStats::timer t(stats, SHUFFLE_PHASE);
+        keyCompare = compare;
+        rangePartitioned = false;
+        pickSplitters();
+        rangePartitioned = true;
+        shuffle();
+        if (!keyValue->has_runs()) sortKeys(); // else reduce_runs merges the runs in key order
+    }
 
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::set_memory_budget(size_t bytes, const char *dir) {
+        if (dir == NULL) dir = getenv("TMPDIR");
+        memoryBudget = bytes != 0 && bytes < MIN_MEMORY_BUDGET ? MIN_MEMORY_BUDGET : bytes;
+        scratchDir = dir != NULL ? dir : "/tmp";
+        keyValue->set_spill(memoryBudget, scratchDir);
     }
 
 /* PRIVATE FUNCTIONS */
@@ -200,187 +828,474 @@ namespace MAPREDUCE_NAMESPACE {
 
 
     template<class Key, class Value>
-    void MapReduce<Key, Value>::distributeTask(char *dirPath) {
-        long totalSize = 0;
-        int numFiles, filesPerTask, remainder, sum = 0;
-
-        std::vector<fileInfo> workVector; // datastructure we use to store fileInfo for further processing
-        /* First explore the directory and obtain information about files */
+    void MapReduce<Key, Value>::distributeTask() {
+        /* Longest processing time first: going from the biggest split down, give each split to the rank with the
+         * fewest bytes so far. Then every rank gets its whole list (serialized fileSplits) in one scatterv. */
+        std::vector<std::string> lists;
+        int *sendcounts = NULL, *displacement = NULL;
+        std::string sendbuf;
+        int recvcount;
         if (nrank == 0) {
-            workVector.reserve(10); // reserve 10?
-            struct stat filestat;   // file stat
-            int status;             // for error checking
-            status = stat(dirPath, &filestat);
-            if (status != 0) fprintf(stderr, "Error stat opening %s: %s\n", dirPath, strerror(errno));
-            if (S_ISDIR(filestat.st_mode)) { // if it's dir then we obtain all the files along with their sizes
-                DIR *directory;     // struct to explore directory
-                struct dirent *result;      // result for direntry
-                directory = opendir(dirPath);
-                if (directory == NULL) {
-                    fprintf(stderr, "Unable to open directory %s: %s\n", dirPath, strerror(errno));
-                    MPI_Abort(MPI_COMM_WORLD, errno);
-                }
-                // now that we have a working directory, we obtain the files and its sizes
-                while (1) {
-                    errno = 0;
-                    result = readdir(directory);
-                    if (result == NULL) {
-                        if (errno != 0) fprintf(stderr, "An error occurred during readdir: %s\n ", strerror(errno));
-                        break; // we have reached the end of directory (or error if printed above)
-                    }
-                    if (result->d_type != DT_REG) { // if it's not a regular file
-                        continue; // ignore??? or error?
-                    }
-                    // ignore . and ..
-                    if (strcmp(result->d_name, ".") == 0) continue;
-                    if (strcmp(result->d_name, "..") == 0) continue;
-                    std::string newPath(dirPath); // this is our new path to our file
-                    newPath += "/";
-                    newPath += result->d_name;  // location to entry
-                    status = stat(newPath.c_str(), &filestat);
-                    if (status != 0) {
-                        fprintf(stderr, "Error stat opening %s: %s\n", dirPath, strerror(errno));
-                        //continue; // should we skip????
-                    }
-                    long fileSize = filestat.st_size; // the fileSize in bytes
-                    totalSize += fileSize; // this totalSize helps calculate the load each task receives
-                    workVector.push_back(fileInfo(newPath, fileSize));
-                }
-            } else { // only take directory as inputs
-                fprintf(stderr, "ERROR: Input directory only. Received: %s \n", dirPath);
-                MPI_Abort(MPI_COMM_WORLD, -1);
+            typedef std::pair<long, int> load; // (bytes assigned, rank)
+            std::priority_queue<load, std::vector<load>, std::greater<load>> ranks;
+            for (int i = 0; i < world_size; i++) ranks.push(load(0, i));
+            lists.resize(world_size);
+            // pool is sorted smallest first so we walk it from the back
+            for (auto split = pool.rbegin(); split != pool.rend(); ++split) {
+                load least = ranks.top();
+                ranks.pop();
+                std::string &list = lists[least.second];
+                size_t pos = list.size();
+                list.resize(pos + Serializer<fileSplit>::size(*split));
+                Serializer<fileSplit>::write(&list[pos], *split);
+                least.first += split->length;
+                ranks.push(least);
             }
-            numFiles = workVector.size();
-
-        } // end if (nrank == 0)
-
-        // let other nodes know of the total size
-        MPI_Bcast(&filesPerTask, 1, MPI_INT, 0, MPI_COMM_WORLD);
-        /* Now we have a vector of file paths and sizes (for 0). We will try to divide up the files as evenly as possible among nodes
-         *  Right now, we assume the input files to be roughly the same size (by splitting)*/
-        filesPerTask = numFiles / world_size;
-        remainder = numFiles % world_size;
-
-        int *sendcounts = new int[world_size];
-        int *displacement = new int[world_size];
-        // calculate size and displacements for scattering
-        for (int i = 0; i < world_size; i++) {
-            sendcounts[i] = filesPerTask;
-            if (remainder > 0) {
-                sendcounts[i]++;
-                remainder--;
+            pool.clear();
+            remainingBytes = 0;
+            sendcounts = new int[world_size];
+            displacement = new int[world_size];
+            int sum = 0;
+            // calculate size and displacements for scattering
+            for (int i = 0; i < world_size; i++) {
+                sendcounts[i] = (int) lists[i].size();
+                displacement[i] = sum;
+                sum += sendcounts[i];
+                sendbuf += lists[i];
             }
-            displacement[i] = sum;
-            sum += sendcounts[i];
         }
-
-        //MPI_Scatterv(&workVector[0]); // this is the array of size numFiles
+        MPI_Scatter(sendcounts, 1, MPI_INT, &recvcount, 1, MPI_INT, 0, comm);
+        std::vector<char> recvbuf(recvcount);
+        MPI_Scatterv(sendbuf.data(), sendcounts, displacement, MPI_CHAR,
+                     recvbuf.data(), recvcount, MPI_CHAR, 0, comm);
+        queueTasks(recvbuf.data(), recvcount);
+        delete[] sendcounts;
+        delete[] displacement;
     }
 
     template<class Key, class Value>
-    void MapReduce<Key, Value>::masterSendPath() {
+    void MapReduce<Key, Value>::scanInput() {
         struct stat filestat;
         int status;
 
+        remainingBytes = 0;
         status = stat(inputPath, &filestat);
-        if (status != 0) fprintf(stderr, "ERROR at stat(inputFile): %d", status);
+        if (status != 0) {
+            fprintf(stderr, "Error stat opening %s: %s\n", inputPath, strerror(errno));
+            MPI_Abort(comm, 1);
+        }
         // only process directory and obtain files from dir
-        if (S_ISDIR(filestat.st_mode)) {
-            DIR *directory;
-            struct dirent *resultd;
-            directory = opendir(inputPath);
-            if (directory == NULL) {
-                fprintf(stderr, "Unable to open directory\n");
-                return;
-            }
-            int dest = 0;  // for sending 1 by 1
-            while (1) {
-                resultd = readdir(directory);
-                if (resultd == NULL) {
-                    break; // end of dir
-                }
-                // skip . and ..
-                if (strcmp(resultd->d_name, ".") == 0) continue;
-                if (strcmp(resultd->d_name, "..") == 0) continue;
-
-                char newpath[path_max];
-                strcpy(newpath, inputPath);
-                strcat(newpath, "/");
-                strcat(newpath, resultd->d_name);
-                // now we send the newpath
-                if (dest == 0) {
-                    DPRINTF(("Sending path %s/%s to %d\n", inputPath, resultd->d_name, dest));
-                    workqueue.push(newpath);
-                } else {
-                    DPRINTF(("Sending path %s/%s to %d\n", inputPath, resultd->d_name, dest));
-                    MPI_Send(newpath, path_max, MPI_CHAR, dest, 0, MPI_COMM_WORLD);
-                }
-
-                /* OPTIMIZE BY SENDING A BUNCH OF PATHS TOGETHER -- PARTITION FIRST
-                 * AND THEN SEND ONCE TO EACH NODE
-                 *  --> WANT TO MINIMIZE COMMUNICATIONS (THE NUMBER OF SEND/RECV CALLS */
-                dest = (dest + 1) % (world_size); // update
+        if (!S_ISDIR(filestat.st_mode)) {
+            fprintf(stderr, "ERROR: Input directory only. Received: %s \n", inputPath);
+            MPI_Abort(comm, 1);
+        }
+        DIR *directory;
+        struct dirent *resultd;
+        directory = opendir(inputPath);
+        if (directory == NULL) {
+            fprintf(stderr, "Unable to open directory %s: %s\n", inputPath, strerror(errno));
+            MPI_Abort(comm, 1);
+        }
+        while (1) {
+            errno = 0;
+            resultd = readdir(directory);
+            if (resultd == NULL) {
+                if (errno != 0) fprintf(stderr, "An error occurred during readdir: %s\n ", strerror(errno));
+                break; // end of dir
             }
-            DPRINTF(("MASTER FINISHING...CLOSING DIR....\n"));
-            closedir(directory);
-        } else {
-            fprintf(stderr, "ERROR: Input directory only.\n");
-            MPI_Finalize();
-            exit(1);
+            // skip . and ..
+            if (strcmp(resultd->d_name, ".") == 0) continue;
+            if (strcmp(resultd->d_name, "..") == 0) continue;
+            std::string newPath(inputPath);
+            newPath += "/";
+            newPath += resultd->d_name;
+            status = stat(newPath.c_str(), &filestat);
+            if (status != 0) {
+                fprintf(stderr, "Error stat opening %s: %s\n", newPath.c_str(), strerror(errno));
+                continue;
+            }
+            if (!S_ISREG(filestat.st_mode)) continue; // only regular files are mapped
+            files.push_back(fileInfo(newPath, filestat.st_size));
+        }
+        closedir(directory);
+        DPRINTF(("MASTER: found %d files in %s\n", (int) files.size(), inputPath));
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::makeSplits(long size) {
+        /* Logical splits only: nothing is copied, each map task just reads its own byte range (see InputSplit) */
+        pool.clear();
+        remainingBytes = 0;
+        for (auto &file : files) {
+            long offset = 0;
+            do {
+                long length = file.fileSize - offset;
+                if (size > 0 && length > size) length = size;
+                pool.push_back(fileSplit{file.fileName, offset, length});
+                offset += length;
+            } while (offset < file.fileSize);
+            remainingBytes += file.fileSize;
+        }
+        // biggest splits are handed out first (from the back) so the small ones even out the tail
+        std::sort(pool.begin(), pool.end(),
+                  [](const fileSplit &a, const fileSplit &b) { return a.length < b.length; });
+        totalBytes = remainingBytes;
+        totalTasks = (long) pool.size();
+        DPRINTF(("MASTER: %d splits, %ld bytes\n", (int) pool.size(), remainingBytes));
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::nextBatch(std::string &batch) {
+        /* guided self scheduling: a batch is worth 1/(2*world_size) of the bytes that are left (at least one split),
+         * so batches are big while there is plenty of work and shrink toward the end of the job.
+         * An empty batch means there is nothing left */
+        batch.clear();
+        long target = remainingBytes / (2 * world_size), bytes = 0;
+        while (!pool.empty()) {
+            const fileSplit &split = pool.back();
+            if (!batch.empty() && bytes + split.length > target) break;
+            size_t pos = batch.size();
+            batch.resize(pos + Serializer<fileSplit>::size(split));
+            Serializer<fileSplit>::write(&batch[pos], split);
+            bytes += split.length;
+            remainingBytes -= split.length;
+            pool.pop_back();
         }
+    }
 
-        //MPI_Bcast( d, 5, MPI_CHAR, 0, MPI_COMM_WORLD);
-        for (int i = 1; i < world_size; i++) // signal done
-            MPI_Send("", 1, MPI_CHAR, i, 1, MPI_COMM_WORLD); // tag 1 for done while tag 0 for work
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::queueTasks(const char *batch, int len) {
+        const char *last = batch + len;
+        while (batch < last) {
+            tasks.push_back(fileSplit());
+            batch = Serializer<fileSplit>::read(batch, tasks.back());
+            deques.back()->push(&tasks.back()); // only the main thread pushes to the inbox
+            DPRINTF(("Processor %s, rank %d: queued %s [%ld, +%ld)\n", processor_name, nrank,
+                    tasks.back().fileName.c_str(), tasks.back().offset, tasks.back().length));
+        }
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::serveWork() {
+        int pending = world_size - 1;   // slaves that have not been told we are done yet
+        bool selfDone = false;
+        std::string batch;
+        MPI_Status status;
+        while (!selfDone || pending > 0) {
+            int flag, dummy;
+            progress();
+            MPI_Iprobe(MPI_ANY_SOURCE, REQUEST_TAG, comm, &flag, &status);
+            if (flag) {
+                MPI_Recv(&dummy, 1, MPI_INT, status.MPI_SOURCE, REQUEST_TAG, comm, MPI_STATUS_IGNORE);
+                nextBatch(batch);
+                MPI_Send(batch.data(), (int) batch.size(), MPI_CHAR, status.MPI_SOURCE,
+                         batch.empty() ? DONE_TAG : WORK_TAG, comm);
+                if (batch.empty()) pending--;
+                continue;
+            }
+            if (!selfDone && deques.back()->size() <= numThreads) { // our own threads are running low
+                nextBatch(batch);
+                if (batch.empty()) selfDone = true;
+                else queueTasks(batch.data(), (int) batch.size());
+                continue;
+            }
+            if (streamSize > 0) pumpStream();
+            usleep(POLL_USEC);
+        }
     }
 
     template<class Key, class Value>
-    void MapReduce<Key, Value>::receiveWork() {
-        int ierr;
+    void MapReduce<Key, Value>::requestWork() {
         MPI_Status status;
-        char buf[path_max];
+        std::vector<char> batch;
+        int len, dummy = 0;
         while (1) {
-            /*MPI_Probe(0, 0, MPI_COMM_WORLD, &status);
-            MPI_Get_count(&status, MPI_CHAR, &path_len);
-            if (path_len == 1) break; // signal (empty str) */
-            ierr = MPI_Recv(&buf, path_max, MPI_CHAR, 0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-            if (ierr != 0) fprintf(stderr, "Error: MPI Receive in receive work: %s \n", strerror(ierr));
-            //DPRINTF(("Processor %s, nrank %d: waiting to receive...\n", processor_name, nrank));
-            if (status.MPI_TAG == 1) {
-                break;
-            } else {
-                workqueue.push(std::string(buf));
-                DPRINTF(("Processor %s, rank %d: Just pushed %s to front of queue\n", processor_name, nrank, workqueue.front().c_str()));
+            if (deques.back()->size() > numThreads) { // still enough queued up for our threads
+                if (streamSize > 0) pumpStream();
+                progress();
+                usleep(POLL_USEC);
+                continue;
+            }
+            Trace::span traced(trace, "work request"); // how long we wait on master
+            MPI_Send(&dummy, 1, MPI_INT, 0, REQUEST_TAG, comm);
+            while (1) { // master's answer (streamed pairs from master have their own tag)
+                int flag;
+                MPI_Iprobe(0, WORK_TAG, comm, &flag, &status);
+                if (!flag) MPI_Iprobe(0, DONE_TAG, comm, &flag, &status);
+                if (flag) break;
+                if (streamSize > 0) pumpStream();
+                progress();
+                usleep(POLL_USEC);
             }
+            MPI_Get_count(&status, MPI_CHAR, &len);
+            batch.resize(len);
+            MPI_Recv(batch.data(), len, MPI_CHAR, 0, status.MPI_TAG, comm, MPI_STATUS_IGNORE);
+            traced.arg("bytes", len);
+            if (status.MPI_TAG == DONE_TAG) break;
+            queueTasks(batch.data(), len);
+        }
+    }
+
+    /* WIRE FORMAT: each pair is the key followed by the value, both encoded with Serializer (see serializer.h).
+     * Pairs for one destination are concatenated into a single byte blob and the blobs of all
+     * destinations are sent with one alltoallv using byte counts and offsets. */
+    template<class Key, class Value>
+    template<class K> // Key, or the string_view KeyValue stores string keys as (same wire format)
+    void MapReduce<Key, Value>::pack_kv(std::vector<char> &buf, const K &k, const Value &v) {
+        size_t pos = buf.size();
+        buf.resize(pos + Serializer<K>::size(k) + Serializer<Value>::size(v));
+        char *out = Serializer<K>::write(&buf[pos], k);
+        Serializer<Value>::write(out, v);
+    }
+
+    template<class Key, class Value>
+    template<class K>
+    const char *MapReduce<Key, Value>::unpack_kv(const char *buf, K &k, Value &v) {
+        buf = Serializer<K>::read(buf, k);
+        return Serializer<Value>::read(buf, v);
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::exchange(std::vector<std::vector<char>> &packages, std::vector<char> &recvbuf,
+                                         MPI_Comm c) {
+        /* send packages[i] to rank i of c and receive everything addressed to us in recvbuf */
+        Trace::span traced(trace, "alltoallv");
+        int size = (int) packages.size(); // c's size
+        int *sendcounts = new int[size];
+        int *senddispls = new int[size];
+        int *recvcounts = new int[size];
+        int *recvdispls = new int[size];
+        long long sendtotal = 0, recvtotal = 0; // counts and displacements are ints: check before casting
+        for (int i = 0; i < size; i++) {
+            sendcounts[i] = (int) packages[i].size();
+            senddispls[i] = (int) sendtotal;
+            sendtotal += (long long) packages[i].size();
+        }
+        if (sendtotal > INT_MAX) {
+            fprintf(stderr, "ERROR: rank %d would send %lld bytes in one alltoallv (more than INT_MAX)\n", nrank,
+                    sendtotal);
+            MPI_Abort(comm, 1);
+        }
+        // let every rank know how many bytes it will receive from everyone else
+        MPI_Alltoall(sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT, c);
+        for (int i = 0; i < size; i++) {
+            recvdispls[i] = (int) recvtotal;
+            recvtotal += recvcounts[i];
+        }
+        if (recvtotal > INT_MAX) {
+            fprintf(stderr, "ERROR: rank %d would receive %lld bytes in one alltoallv (more than INT_MAX)\n", nrank,
+                    recvtotal);
+            MPI_Abort(comm, 1);
+        }
+        std::vector<char> sendbuf(sendtotal);
+        for (int i = 0; i < size; i++) {
+            std::copy(packages[i].begin(), packages[i].end(), sendbuf.begin() + senddispls[i]);
+            std::vector<char>().swap(packages[i]); // free package early
         }
+        recvbuf.resize(recvtotal);
+        MPI_Alltoallv(sendbuf.data(), sendcounts, senddispls, MPI_BYTE,
+                      recvbuf.data(), recvcounts, recvdispls, MPI_BYTE, c);
+        traced.arg("ranks", size).arg("sent", (long) sendtotal).arg("received", (long) recvtotal);
+        delete[] sendcounts;
+        delete[] senddispls;
+        delete[] recvcounts;
+        delete[] recvdispls;
     }
 
     template<class Key, class Value>
-    MPI_Datatype MapReduce<Key, Value>::register_kv_type() { // do i need this?
-        const int structlen = 2;
-        int lengths[structlen] = {MAX_WORD_LEN, 1};
-        MPI_Aint offsets[structlen] = {offsetof(kv, key), offsetof(kv, value)};
-        MPI_Datatype types[structlen];
-        if (std::is_same<Key, std::string>::value && std::is_same<Value, int>::value) {
-            types[0] = MPI_CHAR;
-            types[1] = MPI_INT;
-        } else // todo soon!!!
-            fprintf(stderr, "Warning: not correct type.... registerkvtype.\n");
-        MPI_Datatype kvtype;
-        MPI_Type_struct(structlen, lengths, offsets, types, &kvtype);
-        MPI_Type_commit(&kvtype);
-        return kvtype;
+    void MapReduce<Key, Value>::setupNodes() {
+        /* group the ranks by shared memory node: nodeComm holds our node's ranks, leaderComm the first rank of
+         * every node, and nodeOf tells which node (rank in leaderComm) each rank is on */
+        if (nodeComm != MPI_COMM_NULL) return;
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, nrank, MPI_INFO_NULL, &nodeComm);
+        MPI_Comm_rank(nodeComm, &localRank);
+        MPI_Comm_size(nodeComm, &localSize);
+        MPI_Comm_split(comm, localRank == 0 ? 0 : MPI_UNDEFINED, nrank, &leaderComm);
+        int node[2] = {0, 0}; // our node, number of nodes
+        if (localRank == 0) {
+            MPI_Comm_rank(leaderComm, &node[0]);
+            MPI_Comm_size(leaderComm, &node[1]);
+        }
+        MPI_Bcast(node, 2, MPI_INT, 0, nodeComm);
+        numNodes = node[1];
+        nodeOf.resize(world_size);
+        MPI_Allgather(&node[0], 1, MPI_INT, nodeOf.data(), 1, MPI_INT, comm);
+        localRanks.resize(localSize);
+        MPI_Allgather(&nrank, 1, MPI_INT, localRanks.data(), 1, MPI_INT, nodeComm);
+        MPI_Allreduce(&localSize, &maxLocalSize, 1, MPI_INT, MPI_MAX, comm);
+        DPRINTF(("Processor %s, nrank %d: node %d of %d, local rank %d of %d\n", processor_name, nrank, node[0],
+                numNodes, localRank, localSize));
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::exchangeByNode(std::vector<std::vector<char>> &packages, std::vector<char> &recvbuf) {
+        /* same result as exchange() but only node leaders talk over the network, one aggregated buffer per node:
+         *  1. every rank puts its packages in a shared memory window, the leader reads them in place
+         *  2. leaders alltoallv, per destination node, chunks of [int destination][uint64 length][bytes]
+         *  3. each leader lays the chunks out by local destination in a second window that its ranks copy from */
+        setupNodes();
+        std::vector<long long> sizes(world_size), allSizes(localRank == 0 ? localSize * world_size : 0);
+        long long total = 0;
+        for (int d = 0; d < world_size; d++) total += sizes[d] = (long long) packages[d].size();
+        MPI_Gather(sizes.data(), world_size, MPI_LONG_LONG, allSizes.data(), world_size, MPI_LONG_LONG, 0, nodeComm);
+        char *base;
+        MPI_Win win;
+        MPI_Win_allocate_shared((MPI_Aint) total, 1, MPI_INFO_NULL, nodeComm, &base, &win);
+        for (int d = 0; d < world_size; d++) {
+            base = std::copy(packages[d].begin(), packages[d].end(), base);
+            std::vector<char>().swap(packages[d]); // free package early
+        }
+        MPI_Win_fence(0, win);
+        std::vector<char> fromNodes;
+        if (localRank == 0) {
+            std::vector<std::vector<char>> toNodes(numNodes);
+            for (int src = 0; src < localSize; src++) {
+                MPI_Aint segment;
+                int unit;
+                char *pos;
+                MPI_Win_shared_query(win, src, &segment, &unit, &pos);
+                for (int d = 0; d < world_size; d++) {
+                    uint64_t len = (uint64_t) allSizes[src * world_size + d];
+                    if (len == 0) continue;
+                    std::vector<char> &out = toNodes[nodeOf[d]];
+                    size_t at = out.size();
+                    out.resize(at + sizeof(int) + sizeof(uint64_t) + len);
+                    memcpy(&out[at], &d, sizeof(int));
+                    memcpy(&out[at + sizeof(int)], &len, sizeof(uint64_t));
+                    memcpy(&out[at + sizeof(int) + sizeof(uint64_t)], pos, len);
+                    pos += len;
+                }
+            }
+            exchange(toNodes, fromNodes, leaderComm);
+        }
+        MPI_Win_fence(0, win);
+        MPI_Win_free(&win);
+        // where each chunk goes: the leader sizes every local rank's part, then copies the chunks into place
+        std::vector<long long> parts(localRank == 0 ? 2 * localSize : 0), part(2); // (offset, length) per local rank
+        std::vector<int> localIndex;
+        total = 0;
+        if (localRank == 0) {
+            localIndex.assign(world_size, -1);
+            for (int i = 0; i < localSize; i++) localIndex[localRanks[i]] = i;
+            const char *pos = fromNodes.data(), *last = fromNodes.data() + fromNodes.size();
+            while (pos < last) {
+                int d;
+                uint64_t len;
+                memcpy(&d, pos, sizeof(int));
+                memcpy(&len, pos + sizeof(int), sizeof(uint64_t));
+                parts[2 * localIndex[d] + 1] += (long long) len;
+                pos += sizeof(int) + sizeof(uint64_t) + len;
+            }
+            for (int i = 0; i < localSize; i++) {
+                parts[2 * i] = total;
+                total += parts[2 * i + 1];
+            }
+        }
+        MPI_Scatter(parts.data(), 2, MPI_LONG_LONG, part.data(), 2, MPI_LONG_LONG, 0, nodeComm);
+        MPI_Win_allocate_shared((MPI_Aint) total, 1, MPI_INFO_NULL, nodeComm, &base, &win);
+        if (localRank == 0) {
+            std::vector<long long> filled(localSize, 0);
+            const char *pos = fromNodes.data(), *last = fromNodes.data() + fromNodes.size();
+            while (pos < last) {
+                int d;
+                uint64_t len;
+                memcpy(&d, pos, sizeof(int));
+                memcpy(&len, pos + sizeof(int), sizeof(uint64_t));
+                int i = localIndex[d];
+                memcpy(base + parts[2 * i] + filled[i], pos + sizeof(int) + sizeof(uint64_t), len);
+                filled[i] += (long long) len;
+                pos += sizeof(int) + sizeof(uint64_t) + len;
+            }
+        }
+        MPI_Win_fence(0, win);
+        MPI_Aint segment;
+        int unit;
+        char *leader;
+        MPI_Win_shared_query(win, 0, &segment, &unit, &leader);
+        recvbuf.assign(leader + part[0], leader + part[0] + part[1]);
+        MPI_Win_fence(0, win);
+        MPI_Win_free(&win);
     }
 
     template<class Key, class Value>
     void MapReduce<Key, Value>::write_to_file() {
-        /* given a map output, create a file with filename and write wordcount */
-        std::ofstream outfile(outputPath);
-        // since map is already ordered, we just iterate through it and write to file
-        for (auto i : result) {
-            outfile << i.first << "\t" << i.second << std::endl;
+        /* one "key\tvalue" line per pair of our partition, either in our own file or in our slice of a shared one.
+         * Partitions are disjoint so ranks write in parallel and nobody collects the whole result */
+        if (mkdir(outputPath, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Unable to create output directory %s: %s\n", outputPath, strerror(errno));
+            MPI_Abort(comm, 1);
         }
+        // the result comes out of hash tables so this is the one place we need it ordered
+        std::sort(result.begin(), result.end(), [this](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+            return key_less(a.first, b.first);
+        });
+        if (output == SINGLE_FILE_OUTPUT)
+            write_shared_file();
+        else
+            write_part_file();
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::write_result(std::ostream &out) {
+        for (auto &i : result) {
+            out << i.first << '\t' << i.second << '\n'; // no endl: it would flush every line
+        }
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::write_part_file() {
+        char name[32];
+        snprintf(name, sizeof(name), "/part-r-%05d", nrank);
+        std::string path = std::string(outputPath) + name;
+        std::vector<char> buffer(OUTPUT_BUFFER);
+        std::ofstream outfile;
+        outfile.rdbuf()->pubsetbuf(buffer.data(), buffer.size()); // before open, or libstdc++ ignores it
+        outfile.open(path);
+        if (!outfile) {
+            fprintf(stderr, "Unable to open output file %s: %s\n", path.c_str(), strerror(errno));
+            MPI_Abort(comm, 1);
+        }
+        Trace::span traced(trace, "write part file");
+        traced.arg("path", path).arg("pairs", (long) result.size());
+        write_result(outfile);
         outfile.close();
+        DPRINTF(("Processor %s, nrank %d: wrote %d pairs to %s\n", processor_name, nrank, (int) result.size(),
+                path.c_str()));
+    }
+
+    template<class Key, class Value>
+    void MapReduce<Key, Value>::write_shared_file() {
+        /* format our lines in memory, find where they start in the file with an exclusive prefix sum of the sizes
+         * (rank order, so sort_and_shuffle output stays sorted) and write them with collective MPI-IO */
+        std::ostringstream lines;
+        write_result(lines);
+        std::string bytes = lines.str();
+        long long size = (long long) bytes.size(), offset = 0, total;
+        MPI_Exscan(&size, &offset, 1, MPI_LONG_LONG, MPI_SUM, comm);
+        if (nrank == 0) offset = 0; // Exscan leaves rank 0's undefined
+        MPI_Allreduce(&size, &total, 1, MPI_LONG_LONG, MPI_SUM, comm);
+        std::string path = std::string(outputPath) + "/" + OUTPUT_FILE;
+        MPI_File file;
+        int status = MPI_File_open(comm, path.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+        if (status != MPI_SUCCESS) {
+            fprintf(stderr, "Unable to open output file %s\n", path.c_str());
+            MPI_Abort(comm, 1);
+        }
+        MPI_File_set_size(file, total); // drop whatever an older, longer file had past our end
+        // counts are ints so big partitions go in pieces, and every rank joins every collective write
+        long long pieces = (size + OUTPUT_PIECE - 1) / OUTPUT_PIECE, maxPieces;
+        MPI_Allreduce(&pieces, &maxPieces, 1, MPI_LONG_LONG, MPI_MAX, comm);
+        Trace::span traced(trace, "write shared file");
+        traced.arg("offset", (long) offset).arg("bytes", (long) size);
+        long long written = 0;
+        for (long long i = 0; i < maxPieces; i++) {
+            int count = (int) std::min(size - written, (long long) OUTPUT_PIECE); // 0 once we are done
+            MPI_File_write_at_all(file, offset + written, bytes.data() + written, count, MPI_BYTE, MPI_STATUS_IGNORE);
+            written += count;
+        }
+        MPI_File_close(&file);
+        DPRINTF(("Processor %s, nrank %d: wrote %lld bytes at %lld of %s\n", processor_name, nrank, size, offset,
+                path.c_str()));
     }
 
 /* ITERATOR TO ITERATE THROUGH KV PAIRS */
@@ -404,7 +1319,7 @@ namespace MAPREDUCE_NAMESPACE {
 
 
     template<class Key, class Value>
-    std::pair<Key, std::vector<Value>> MapReduce<Key, Value>::Iterator::operator*()  {
+    typename MapReduce<Key, Value>::kvReference MapReduce<Key, Value>::Iterator::operator*() const {
         return *current;
     };
 
@@ -436,4 +1351,9 @@ namespace MAPREDUCE_NAMESPACE {
 
     /* We have to define this so the linker won't complain ... */
     template class MapReduce<std::string, int>;
+    template class MapReduce<std::string, long>;
+    template class MapReduce<std::string, double>;
+    template class MapReduce<std::string, std::string>;
+    template class MapReduce<uint64_t, double>;
+    template class MapReduce<uint64_t, uint64_t>;
 }
\ No newline at end of file
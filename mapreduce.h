@@ -7,22 +7,53 @@
 
 #include "mpi.h"
 #include "keyvalue.h"
+#include "serializer.h"
+#include "workdeque.h"
+#include "inputsplit.h"
+#include "stats.h"
 
 #include <string>
 #include <iostream>
-#include <map>
-#include <queue>
+#include <atomic>
+#include <deque>
+#include <vector>
 
 #define MAXTHREADS 5 // this is for mappers to spawn threads
-#define MAX_WORD_LEN 128 // only support up to 128 word len for counting... can do variable but inefficient...
+#define POLL_USEC 200 // how long idle map threads and the work distributor sleep before looking again
+#define SPLIT_SIZE (64L << 20) // default size of the byte range splits handed to InputSplit map functions
+#define MIN_MEMORY_BUDGET (1L << 20) // smaller budgets are raised to this (key arenas grow by 64KB chunks)
+#define OUTPUT_BUFFER (1 << 20) // stream buffer for writing the output partitions
+#define OUTPUT_PIECE (1 << 30) // most bytes per MPI_File_write_at_all or tree reduction message (counts are ints)
+#define OUTPUT_FILE "part-r-all" // name of the single output file under outputPath (SINGLE_FILE_OUTPUT)
+#define SORT_SAMPLES 256 // keys each rank contributes for picking the sample sort splitters
 
 
 namespace MAPREDUCE_NAMESPACE {
 
-typedef struct kv{ // kv struct for use with reduction
-    char key[MAX_WORD_LEN];
-    int value;
-} kv;
+enum { WORK_TAG = 0, DONE_TAG = 1, REQUEST_TAG = 2 }; // tags for distributing map tasks
+enum { REDUCE_TAG = 3 };    // partial results going up the reduction tree
+enum { STREAM_TAG = 4 };    // pairs shuffled while mapping (see set_stream_size)
+enum { PROGRESS_TAG = 5 };  // map progress reports to master (see set_progress)
+
+enum distributionMode {     // how map tasks get to the ranks (see set_distribution)
+    DYNAMIC_DISTRIBUTION,   // ranks pull batches from master as they run low (default)
+    STATIC_DISTRIBUTION     // master balances the files by size up front and scatters them once
+};
+
+enum reduceMode {           // how the keys of all ranks come together (see set_reduce_mode)
+    SHUFFLE_REDUCE,         // shuffle so every rank reduces its own key range (default)
+    TREE_REDUCE             // every rank reduces its own pairs, partial results are combined up a binomial tree
+};
+
+enum shuffleMode {          // how shuffled pairs travel between ranks (see set_shuffle_mode)
+    FLAT_SHUFFLE,           // one alltoallv among all ranks (default)
+    NODE_AWARE_SHUFFLE      // ranks of a node pool their pairs in shared memory, node leaders exchange them
+};
+
+enum outputMode {           // how the reduced pairs are written under outputPath (see set_output_mode)
+    PARTITIONED_OUTPUT,     // every rank writes its own part-r-NNNNN file (default)
+    SINGLE_FILE_OUTPUT      // every rank writes its slice of one OUTPUT_FILE with MPI-IO
+};
 
 struct fileInfo{ // for storing fileInfo
     std::string fileName;
@@ -39,9 +70,53 @@ class MapReduce {
 private:
     /* Work related variables */
     char * inputPath, *outputPath;      // 2 paths provided by user for input and output
-    std::map<Key,Value> result;              // result map to store results
-    std::queue<std::string> workqueue;            // queue to distribute work
-    pthread_mutex_t countLock;          // mutex lock for obtaining and distributing work (inside slaves)
+    std::vector<std::pair<Key,Value>> result;   // reduced pairs of this rank's key range
+    std::deque<fileSplit> tasks;        // splits this rank has received so far (push_back keeps references valid)
+    std::vector<WorkDeque<const fileSplit *> *> deques; // one per map thread plus the inbox fed by distributeWork
+    std::atomic<bool> noMoreWork;       // set once distributeWork has queued the last task of this rank
+    std::vector<fileInfo> files;        // master only: the regular files under inputPath
+    std::vector<fileSplit> pool;        // master only: splits not handed out yet, smallest first
+    long remainingBytes;                // master only: total length of the splits in pool
+    long totalBytes, totalTasks;        // master only: size of the map (for progress)
+    long splitSize;                     // files bigger than this are cut into splits for InputSplit map functions
+    distributionMode distribution;      // dynamic (pull) or static (one scatter) task distribution
+    pthread_key_t kvKey;                // each map thread's own KeyValue so emit never takes a lock
+    pthread_key_t counterKey;           // and its own user counters
+    int numThreads;                     // number of map threads per rank (MAXTHREADS by default)
+    size_t memoryBudget;                // bytes of intermediate pairs a rank keeps in memory (0: no limit)
+    std::string scratchDir;             // where pairs over the budget are spilled as sorted runs
+    bool (*keyCompare)(Key, Key);       // output order given to sort_and_shuffle (NULL: operator<)
+    std::vector<Key> splitters;         // rank i owns the keys between splitters i-1 and i (after sort_and_shuffle)
+    bool rangePartitioned;              // sort_and_shuffle already did the shuffle: keys are partitioned by range
+    outputMode output;                  // part files or one shared file
+    reduceMode reduction;               // shuffle or tree reduction
+    shuffleMode shuffleTopology;        // flat or two level shuffle
+    MPI_Comm nodeComm, leaderComm;      // ranks on our node / first rank of every node (NULL until needed)
+    int localRank, localSize, numNodes; // our place on the node
+    int maxLocalSize;                   // ranks on the most crowded node
+    std::vector<int> nodeOf;            // node (rank in leaderComm) of every rank
+    std::vector<int> localRanks;        // ranks in comm of our node's ranks
+    /* streaming shuffle: map threads queue packed pairs in outbox, the main thread sends them while mapping */
+    size_t streamSize;                  // a map thread ships its pairs once they pass this many bytes (0: off)
+    std::atomic<int> runningThreads;    // map threads that have not finished yet
+    pthread_mutex_t outboxMutex;
+    std::deque<std::pair<int, std::vector<char>>> outbox; // (destination rank, packed pairs)
+    KeyValue<Key, Value> *streamed;     // pairs received while mapping, merged into keyValue after the map
+    std::vector<MPI_Request> sendRequests, recvRequests;
+    std::vector<std::vector<char>> sendBuffers, recvBuffers; // same order as the requests
+    std::vector<long> sendTraces, recvTraces; // and their async trace events
+    std::vector<int> sentTo, receivedFrom; // streamed messages per rank, to know when everything has arrived
+    /* live progress: every rank reports what its map threads have done, master prints a status line */
+    double progressInterval;            // seconds between reports (0: off)
+    FILE *progressOut;                  // where master prints
+    std::atomic<long> bytesMapped, tasksMapped; // this rank's finished map tasks, bumped by the map threads
+    double progressStart, lastProgress; // MPI_Wtime at the start of the map and of the last report
+    long progressMessage[3];            // slaves: (bytes, tasks, final) of the report in flight
+    MPI_Request progressRequest;
+    std::vector<long> rankBytes, rankTasks; // master: latest report of every rank
+    int finalReports;                   // master: ranks that are done mapping
+    JobStats stats;                     // phase times and counters of this rank (see print_stats)
+    Trace trace;                        // timeline of this rank's threads (see set_trace), off by default
     // variables for directory
     size_t path_max;
     size_t name_max;
@@ -53,15 +128,59 @@ private:
 
 
     /* WORK COMMUNICATION FOR DISTRIBUTING TASKS */
-    void distributeTask(char * dirPath); // to distribute task from master to workers --> assign slaves dir to file
-    void distributeWork();
-    void masterSendPath();              // explore path and send workers work
-    void receiveWork();                 // slaves receive work from master
-    void reduceCommunication();         // send final results to master
+    void distributeTask();              // static mode: balance the files by bytes and scatter each rank its list
+    void distributeWork();              // runs on the main thread during the map: keeps the inbox deque stocked
+    void scanInput();                   // master: stat the files under inputPath into files
+    void makeSplits(long size);         // master: cut files into splits of at most size bytes (whole files if 0)
+    void nextBatch(std::string &batch); // master: take the next batch of splits off pool (serialized fileSplits)
+    void queueTasks(const char *batch, int len); // add a batch to tasks and push it on the inbox deque
+    void serveWork();                   // master: answer slaves' requests and feed its own inbox
+    void requestWork();                 // slaves: ask master for a batch whenever the inbox runs low
+    void shuffle();                     // hash (or range) partition intermediate kv pairs and exchange them among all ranks
+    void sampleKeys(std::vector<char> &sample); // pick up to SORT_SAMPLES of our keys (serialized) at random
+    void pickSplitters();               // allgather every rank's sample and choose world_size-1 splitters
+    template<class K> int owner(const K &k); // rank a key is sent to in the shuffle
+    bool key_less(const Key &a, const Key &b) const { return keyCompare != NULL ? keyCompare(a, b) : a < b;}
+    void sortKeys();                    // order our intermediate keys with key_less (after a range shuffle)
+    runOrder keyOrder();                // key_less on encoded keys: spilled runs of a range shuffle are kept in it
+    void reduce_runs(void (*f)(MapReduce<Key, Value> *)); // reduce a spilled partition a budget's worth at a time
+    void treeReduce();                  // combine every rank's sorted result into master's, log2(world_size) rounds
+    void mergeResult(const std::vector<char> &partial); // fold a packed sorted partial result into ours
 
     /* Other utility functions */
-    MPI_Datatype register_kv_type();    // function to register MPI type for sending
+    template<class K> void pack_kv(std::vector<char> &buf, const K &k, const Value &v); // append a kv pair to buf
+    template<class K> const char * unpack_kv(const char *buf, K &k, Value &v); // read a kv pair, return next position
+    void exchange(std::vector<std::vector<char>> &packages, std::vector<char> &recvbuf, MPI_Comm c); // alltoallv bytes
+    void exchangeByNode(std::vector<std::vector<char>> &packages, std::vector<char> &recvbuf); // two level exchange
+    void setupNodes();                  // create nodeComm and leaderComm
+    void write_result(std::ostream &out); // our sorted result as text lines
+    void write_part_file();             // PARTITIONED_OUTPUT
+    void write_shared_file();           // SINGLE_FILE_OUTPUT
     void setup_machine_specifics();     // setup and initialize variables like path_max, name_max, etc.
+
+    /* MAP THREADS */
+    typedef void (*mapFunction)(MapReduce<Key, Value> *, const char *);
+    typedef void (*splitMapFunction)(MapReduce<Key, Value> *, InputSplit &);
+    struct engineArgs {                 // what mapper() hands to each of its threads
+        MapReduce<Key, Value> *mr;
+        int id;                         // index of the thread's own deque
+        mapFunction f;                  // exactly one of f and sf is set
+        splitMapFunction sf;
+        KeyValue<Key, Value> *localKV;  // the thread's own intermediate pairs, merged into keyValue after join
+        long bytesRead;                 // input bytes of the tasks the thread mapped
+        counterSlots counters;          // the thread's user counters, folded into stats after join
+        traceLog events;                // the thread's trace events, merged into trace after join
+    };
+    static void * engine_entry(void *); // pthread entry point: calls engine() on the args' MapReduce
+    bool next_task(int id, const fileSplit *&task); // pop our own deque, refill it from the inbox, or steal
+    void run_map(mapFunction f, splitMapFunction sf); // the map phase behind both mapper()s
+    void streamOut(KeyValue<Key, Value> &kv); // map threads: pack kv's pairs by owner into outbox and clear kv
+    void pumpStream();                  // main thread: post sends for outbox, receive and absorb what has arrived
+    void finishStream();                // main thread: after the map, wait until every streamed message is in
+    void progress();                    // main thread, when a report is due: slaves send one, master prints
+    void collectProgress();             // master: take in the reports that have arrived
+    void printProgress(bool done);      // master: the status line
+    void finishProgress();              // after the map: slaves send their final report, master waits for them all
 public:
     KeyValue<Key, Value> *keyValue;     // keyValue class for mapping and reducing purposes... middleman style
     explicit MapReduce(MPI_Comm comm, char* inputPath, char* outputPath);       // setup all the private variables and initializes MPI
@@ -70,21 +189,88 @@ public:
     // the user will write the mapping function f (that only uses filename) to process file and emit (add) a kv pair.
     // Then the user will call map during mapping phase and mapreduce will take all files provided and run the function f on appropriate
     // machines (NOTE: Add ability for user to customize which node to run map on in the future)...
-    void * engine(void*); // engine for mapper's threads
-    void mapper( void (*f)(MapReduce<Key, Value> *, const char *));
-    void reducer ( void (*f)(MapReduce<Key, Value> *) );        // user pass in output location?
+    // The map function is run concurrently by up to get_num_threads() threads per rank so it must be thread safe
+    // (emit itself is: every thread emits into its own KeyValue).
+    void * engine(void*); // engine for mapper's threads (takes an engineArgs *)
+    void mapper( void (*f)(MapReduce<Key, Value> *, const char *));     // f gets whole files by path
+    void mapper( void (*f)(MapReduce<Key, Value> *, InputSplit &));     // f reads the records of a byte range split
+    void reducer ( void (*f)(MapReduce<Key, Value> *) );        // shuffle then reduce each rank's own key range
     void emit(Key , Value);                                     // emit to kv class for mapper to send kv pairs
+    template<class K = Key> // string keys: emit straight from a view into the input (e.g. InputSplit tokens)
+    typename std::enable_if<std::is_same<K, std::string>::value>::type emit(std::string_view k, Value v) {
+        KeyValue<Key, Value> *kv = (KeyValue<Key, Value> *) pthread_getspecific(kvKey); // set by map threads
+        (kv != NULL ? kv : keyValue)->add_kv(k, v);
+    }
     void emit_final(Key,Value);                                 // emit to final map for output
-    void sort_and_shuffle(bool (*compare)(Key, Key) = NULL);    // intermediate function user cal;
-    void write_to_file();
+    template<class K = Key> // string keys: the key view of the reduce iterator can be emitted as is
+    typename std::enable_if<std::is_same<K, std::string>::value>::type emit_final(std::string_view k, Value v) {
+        keyValue->add_kv_final(k, v);
+    }
+    // optional combiner: f(a, b) must be associative and commutative (e.g. a + b for counts). Values emitted for a key
+    // are then folded into one running value as they are emitted (and again as they arrive in the shuffle), so each
+    // rank keeps one value per distinct key instead of one per emit. The reducer still sees a vector of values.
+    void set_combiner(Value (*f)(const Value &, const Value &)){ keyValue->set_combiner(f);}
+    // optional, between mapper() and reducer(): shuffle by key range instead of hash (sample sort) so rank 0 gets the
+    // smallest keys, rank 1 the next ones, etc. and the reducer sees its keys in order. compare(a, b) is true when
+    // a goes before b (NULL: operator<). The output is written in this order too
+    void sort_and_shuffle(bool (*compare)(Key, Key) = NULL);
+    void write_to_file();                                       // this rank's result to outputPath (see outputMode)
+
+    // per phase wall/CPU times and counters, min/max/mean across ranks (collective: call on every rank, typically
+    // after reducer(); rank 0 prints)
+    void print_stats(FILE *out = stdout){ stats.report(comm, out);}
+    // user counters, e.g. mr->counter("malformed_lines").add(1). The returned counter is the calling thread's own
+    // slot: add() is a plain increment, and the reference stays valid in that thread until the end of the map (for
+    // the main thread: for the MapReduce's lifetime). Looking up by name takes a lock, so in hot loops look it up
+    // once (or keep its counter_id) and hold on to the reference:
+    //      userCounter &bad = mr->counter("malformed_lines"); ... bad.add(1);
+    int counter_id(std::string_view name){ return stats.counter_id(name);}
+    userCounter & counter(int id){
+        counterSlots *slots = (counterSlots *) pthread_getspecific(counterKey); // set by map threads
+        return slots != NULL ? counter_slot(*slots, id) : stats.counter(id);
+    }
+    userCounter & counter(std::string_view name){ return counter(counter_id(name));}
+    // every user counter summed over all ranks (on rank 0) as of the end of the last map or reduce phase, when the
+    // ranks add them up with one reduce. print_stats shows them too
+    const std::map<std::string, long> & get_counters(){ return stats.totals();}
+    // collective, opt-in: record a timeline of phases, map tasks, messages, reduce and write steps. Every rank writes
+    // dir/trace-r-<rank>.json when the MapReduce is deleted (merge them to load in chrome://tracing or Perfetto)
+    void set_trace(const char *dir){ trace.enable(comm, dir);}
 
     /* Queries */
     char * get_processor_name(){ return processor_name; }
     int get_world_size(){ return world_size;}
     int get_nrank(){ return nrank;}
+    int get_num_threads(){ return numThreads;}
+    void set_num_threads(int n){ numThreads = n > 0 ? n : 1;}  // call before mapper()
+    void set_distribution(distributionMode mode){ distribution = mode;} // call before mapper() on every rank
+    void set_split_size(long bytes){ splitSize = bytes;}        // call before mapper() on master (0: whole files)
+    void set_output_mode(outputMode mode){ output = mode;}      // call before reducer() on every rank
+    // TREE_REDUCE skips the shuffle: each rank reduces the pairs it mapped and the partial results are folded with the
+    // combiner, so the reduce must be the combiner applied over the values (like summing). Master writes the result.
+    // Call before reducer() on every rank, after set_combiner()
+    void set_reduce_mode(reduceMode mode){ reduction = mode;}
+    // NODE_AWARE_SHUFFLE pays off with several ranks per node (hostfile slots): only one buffer per pair of nodes goes
+    // over the network. Call before reducer() (or sort_and_shuffle()) on every rank
+    void set_shuffle_mode(shuffleMode mode){ shuffleTopology = mode;}
+    // start shuffling during the map: whenever a map thread holds more than bytes of pairs after a task they are
+    // sent to the ranks that own them (MPI_Isend) while mapping goes on, and received as they arrive. The shuffle
+    // in reducer() then only moves what is left. Call before mapper() on every rank (0: off, the default)
+    void set_stream_size(size_t bytes){ streamSize = bytes;}
+    // print a live status line of the map on master every seconds: MB done, MB/s, ETA, tasks and the slowest rank.
+    // Each rank reports with a small non-blocking message. Call before mapper() on every rank (0: off, the default)
+    void set_progress(double seconds, FILE *out = stderr){ progressInterval = seconds; progressOut = out;}
+    // cap the intermediate pairs kept in memory per rank; the rest goes to sorted runs in scratchDir ($TMPDIR or
+    // /tmp by default) and is merged back in key order. A partition that still doesn't fit is reduced a budget's
+    // worth of keys per call of the reduce function, in sort_and_shuffle's order if it was called (else in no
+    // particular order, the output is sorted anyway). Call before mapper() on every rank (0: no limit)
+    void set_memory_budget(size_t bytes, const char *scratchDir = NULL);
     class Iterator;
     Iterator begin ()   ;
     Iterator end()      ;
+    // what the reduce iterator yields: a reference to the stored (key, values) entry, nothing is copied.
+    // first is the key (a std::string_view for std::string keys, valid during the reducer), second all its values
+    typedef const typename KeyValue<Key, Value>::kvMap::value_type & kvReference;
     class Iterator {    // iterator class for user to loop through kv pairs with vector of values
     public:
         friend Iterator MapReduce<Key, Value>::begin();
@@ -94,9 +280,9 @@ public:
         MapReduce<Key,Value>::Iterator operator++(int);
         bool operator == (const MapReduce<Key,Value>::Iterator& rhs) const;
         bool operator != (const MapReduce<Key,Value>::Iterator& rhs) const;
-        std::pair<Key,std::vector<Value>> operator* () ;      // dereferencing this iterator returns the collated kv pair
+        kvReference operator* () const;                      // dereferencing this iterator returns the collated kv pair
     private:
-        typename std::map<Key, std::vector<Value>>::const_iterator current;
+        typename KeyValue<Key, Value>::kvMap::const_iterator current;
         explicit Iterator(KeyValue<Key,Value> *kv, int);
     };
 
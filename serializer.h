@@ -0,0 +1,77 @@
+//
+// Created by timmytonga on 8/2/18.
+//
+
+#ifndef MAPREDUCECPP_SERIALIZER_H
+#define MAPREDUCECPP_SERIALIZER_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+/* Serializer<T> tells MapReduce how to put a T on the wire during the shuffle.
+ *      size(t)         number of bytes write(out, t) will produce
+ *      write(out, t)   encode t at out and return the position right after it
+ *      read(in, t)     decode t from in and return the position right after it
+ * Trivially copyable types (int, double, uint64_t, plain structs...) are memcpy'd and strings are
+ * length prefixed. For anything else the user provides a full specialization, e.g.
+ *      template<> struct Serializer<MyType> { static size_t size(const MyType &); ... };
+ * which must be visible where MapReduce<Key, Value> is instantiated (bottom of mapreduce.cpp). */
+template<class T, class Enable = void>
+struct Serializer; // no generic fallback on purpose: unknown types fail to compile instead of sending garbage
+
+template<class T>
+struct Serializer<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+    static size_t size(const T &) { return sizeof(T); }
+    static char * write(char *out, const T &t) {
+        memcpy(out, &t, sizeof(T));
+        return out + sizeof(T);
+    }
+    static const char * read(const char *in, T &t) {
+        memcpy(&t, in, sizeof(T));
+        return in + sizeof(T);
+    }
+};
+
+template<>
+struct Serializer<std::string> { // uint32_t length followed by the bytes (no null char)
+    static size_t size(const std::string &s) { return sizeof(uint32_t) + s.size(); }
+    static char * write(char *out, const std::string &s) {
+        uint32_t len = (uint32_t) s.size();
+        memcpy(out, &len, sizeof(len));
+        memcpy(out + sizeof(len), s.data(), len);
+        return out + sizeof(len) + len;
+    }
+    static const char * read(const char *in, std::string &s) {
+        uint32_t len;
+        memcpy(&len, in, sizeof(len));
+        s.assign(in + sizeof(len), len);
+        return in + sizeof(len) + len;
+    }
+};
+
+template<>
+struct Serializer<std::string_view> { // same wire format as std::string. read gives a view into the buffer
+    static size_t size(std::string_view s) { return sizeof(uint32_t) + s.size(); }
+    static char * write(char *out, std::string_view s) {
+        uint32_t len = (uint32_t) s.size();
+        memcpy(out, &len, sizeof(len));
+        memcpy(out + sizeof(len), s.data(), len);
+        return out + sizeof(len) + len;
+    }
+    static const char * read(const char *in, std::string_view &s) {
+        uint32_t len;
+        memcpy(&len, in, sizeof(len));
+        s = std::string_view(in + sizeof(len), len);
+        return in + sizeof(len) + len;
+    }
+};
+
+} // namespace
+
+#endif //MAPREDUCECPP_SERIALIZER_H
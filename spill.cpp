@@ -0,0 +1,155 @@
+//
+// Created by timmytonga on 8/20/18.
+//
+
+#include "spill.h"
+#include "errors.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+    RunWriter::RunWriter(const std::string &scratchDir) {
+        std::string name = scratchDir + "/mapreduce-run-XXXXXX";
+        std::vector<char> temp(name.begin(), name.end());
+        temp.push_back('\0');
+        int fd = mkstemp(temp.data());
+        if (fd < 0) errno_abort("Unable to create run file in scratch dir");
+        path = temp.data();
+        file = fdopen(fd, "wb");
+        if (file == NULL) errno_abort("Unable to open run file");
+        setvbuf(file, NULL, _IOFBF, SPILL_BUFFER);
+    }
+
+    RunWriter::~RunWriter() {
+        close();
+    }
+
+    void RunWriter::put_varint(uint64_t v) {
+        while (v >= 0x80) {
+            putc((int) (v & 0x7f) | 0x80, file);
+            v >>= 7;
+        }
+        putc((int) v, file);
+    }
+
+    void RunWriter::add(std::string_view key, uint32_t count, std::string_view block) {
+        size_t shared = 0, most = std::min(key.size(), last.size());
+        while (shared < most && key[shared] == last[shared]) shared++;
+        put_varint(shared);
+        put_varint(key.size() - shared);
+        fwrite(key.data() + shared, 1, key.size() - shared, file);
+        put_varint(count);
+        put_varint(block.size());
+        fwrite(block.data(), 1, block.size(), file);
+        last.assign(key.data(), key.size());
+    }
+
+    void RunWriter::close() {
+        if (file == NULL) return;
+        if (fclose(file) != 0) errno_abort("Unable to write run file");
+        file = NULL;
+    }
+
+
+    RunReader::RunReader(const std::string &path) : valueCount(0) {
+        file = fopen(path.c_str(), "rb");
+        if (file == NULL) errno_abort("Unable to open run file");
+        setvbuf(file, NULL, _IOFBF, SPILL_BUFFER);
+    }
+
+    RunReader::~RunReader() {
+        fclose(file);
+    }
+
+    bool RunReader::get_varint(uint64_t &v) {
+        int c, shift = 0;
+        v = 0;
+        do {
+            c = getc(file);
+            if (c == EOF) return false;
+            v |= (uint64_t) (c & 0x7f) << shift;
+            shift += 7;
+        } while (c & 0x80);
+        return true;
+    }
+
+    bool RunReader::next() {
+        uint64_t shared, suffix, count, blocklen;
+        if (!get_varint(shared)) return false; // end of run
+        if (!get_varint(suffix) || shared > keybuf.size()) msg_abort("Corrupt run file");
+        keybuf.resize(shared + suffix);
+        if (fread(&keybuf[shared], 1, suffix, file) != suffix) msg_abort("Corrupt run file");
+        if (!get_varint(count) || !get_varint(blocklen)) msg_abort("Corrupt run file");
+        valueCount = (uint32_t) count;
+        blockbuf.resize(blocklen);
+        if (fread(&blockbuf[0], 1, blocklen, file) != blocklen) msg_abort("Corrupt run file");
+        return true;
+    }
+
+
+    RunMerger::RunMerger(const std::vector<std::string> &runs, const runOrder &order) : paths(runs), less(order) {
+        auto cmp = [this](int a, int b) { return greater(a, b); };
+        for (size_t i = 0; i < paths.size(); i++) {
+            readers.push_back(new RunReader(paths[i]));
+            if (readers[i]->next()) {
+                heap.push_back((int) i);
+                std::push_heap(heap.begin(), heap.end(), cmp);
+            }
+        }
+    }
+
+    RunMerger::~RunMerger() {
+        for (auto r : readers) delete r;
+        for (auto &p : paths) unlink(p.c_str());
+    }
+
+    bool RunMerger::next_group() {
+        auto cmp = [this](int a, int b) { return greater(a, b); };
+        // the runs of the previous group move on to their next record
+        for (int r : group) {
+            if (readers[r]->next()) {
+                heap.push_back(r);
+                std::push_heap(heap.begin(), heap.end(), cmp);
+            }
+        }
+        group.clear();
+        if (heap.empty()) return false;
+        std::pop_heap(heap.begin(), heap.end(), cmp);
+        group.push_back(heap.back());
+        heap.pop_back();
+        while (!heap.empty() && readers[heap.front()]->key() == key()) {
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            group.push_back(heap.back());
+            heap.pop_back();
+        }
+        return true;
+    }
+
+    void compact_runs(std::vector<std::string> &runs, const std::string &scratchDir, size_t maxRuns,
+                      const runOrder &less) {
+        while (runs.size() > maxRuns) {
+            size_t n = std::min(runs.size() - maxRuns + 1, (size_t) MERGE_FANIN);
+            std::vector<std::string> oldest(runs.begin(), runs.begin() + n);
+            runs.erase(runs.begin(), runs.begin() + n);
+            RunWriter out(scratchDir);
+            RunMerger merger(oldest, less);
+            std::string block;
+            while (merger.next_group()) {
+                uint32_t count = 0;
+                block.clear();
+                for (size_t i = 0; i < merger.blocks(); i++) {
+                    block += merger.block(i);
+                    count += merger.count(i);
+                }
+                out.add(merger.key(), count, block);
+            }
+            out.close();
+            runs.push_back(out.get_path());
+        }
+    }
+
+}
@@ -0,0 +1,96 @@
+//
+// Created by timmytonga on 8/20/18.
+//
+
+#ifndef MAPREDUCECPP_SPILL_H
+#define MAPREDUCECPP_SPILL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define SPILL_BUFFER (1 << 20) // stdio buffer size for run files
+#define MERGE_FANIN 64          // most runs merged (and open) at once
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+/* The order of the records in a run: less(a, b) on Serializer encoded keys. Empty means plain byte order, which is
+ * all a merge needs; sort_and_shuffle gives its key order so merged runs come out the way the reducer must see them */
+typedef std::function<bool(std::string_view, std::string_view)> runOrder;
+
+// less, with byte order breaking ties so different keys that less finds equivalent never interleave in a merge
+inline bool run_less(const runOrder &less, std::string_view a, std::string_view b) {
+    if (!less) return a < b;
+    if (less(a, b)) return true;
+    return !less(b, a) && a < b;
+}
+
+/* Sorted runs are what a KeyValue spills to local scratch when it goes over its memory budget. A run is a sequence
+ * of records in increasing key order (see runOrder), one per distinct key:
+ *      varint shared       bytes the key has in common with the previous record's key
+ *      varint suffixlen    followed by that many bytes: the rest of the key
+ *      varint count        number of values
+ *      varint blocklen     followed by that many bytes: the values, back to back
+ * Keys and values are Serializer encoded so this file knows nothing about the types. Sharing the prefix of sorted
+ * keys (front coding) is the compression: for text keys it typically halves the key bytes, without any dependency. */
+class RunWriter {
+public:
+    explicit RunWriter(const std::string &scratchDir); // creates a new run file in scratchDir
+    ~RunWriter();
+    void add(std::string_view key, uint32_t count, std::string_view block); // keys must come in the run's order
+    void close();
+    const std::string & get_path() const { return path; }
+private:
+    std::string path;
+    FILE *file;
+    std::string last;   // previous key, for the shared prefix
+    void put_varint(uint64_t v);
+};
+
+class RunReader {
+public:
+    explicit RunReader(const std::string &path);
+    ~RunReader();
+    bool next();        // move to the next record, false at the end of the run
+    std::string_view key() const { return keybuf; }       // valid until next()
+    std::string_view block() const { return blockbuf; }
+    uint32_t count() const { return valueCount; }
+private:
+    FILE *file;
+    std::string keybuf, blockbuf;
+    uint32_t valueCount;
+    bool get_varint(uint64_t &v);
+};
+
+/* k-way merge of runs: next_group() positions on the smallest key not seen yet and collects the records of every
+ * run that has it. The runs must all be sorted by less. Run files are deleted once the merger is destroyed. */
+class RunMerger {
+public:
+    explicit RunMerger(const std::vector<std::string> &paths, const runOrder &less = runOrder());
+    ~RunMerger();
+    bool next_group();
+    std::string_view key() const { return readers[group[0]]->key(); }
+    size_t blocks() const { return group.size(); }
+    std::string_view block(size_t i) const { return readers[group[i]]->block(); }
+    uint32_t count(size_t i) const { return readers[group[i]]->count(); }
+private:
+    std::vector<std::string> paths;
+    std::vector<RunReader *> readers;
+    std::vector<int> heap;      // readers that have a record and are not in the current group, min key on top
+    std::vector<int> group;     // readers positioned on the current key
+    runOrder less;
+    bool greater(int a, int b) const { return run_less(less, readers[b]->key(), readers[a]->key()); }
+};
+
+// merge the oldest runs together until at most maxRuns are left (so a RunMerger never needs too many open files).
+// Records of the same key are joined into one: their blocks are concatenated. The runs are sorted by less
+void compact_runs(std::vector<std::string> &runs, const std::string &scratchDir, size_t maxRuns = MERGE_FANIN,
+                  const runOrder &less = runOrder());
+
+} // namespace
+
+#endif //MAPREDUCECPP_SPILL_H
@@ -0,0 +1,141 @@
+//
+// Created by timmytonga on 8/27/18.
+//
+
+#include "stats.h"
+#include "errors.h"
+
+#include <sys/resource.h>
+#include <time.h>
+#include <set>
+#include <vector>
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+    static const char *phaseNames[NUM_PHASES] = {"distribute", "map", "combine", "shuffle", "reduce", "write"};
+    static const char *counterNames[NUM_COUNTERS] = {"bytes read", "pairs emitted", "bytes sent", "bytes received"};
+
+    static double seconds(clockid_t clock) {
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    JobStats::JobStats() {
+        for (int i = 0; i < NUM_PHASES; i++) wall[i] = cpu[i] = 0;
+        for (int i = 0; i < NUM_COUNTERS; i++) counters[i] = 0;
+        trace = NULL;
+        int status = pthread_mutex_init(&namesMutex, NULL);
+        if (status != 0) err_abort(status, "Init counter names mutex");
+    }
+
+    JobStats::~JobStats() {
+        pthread_mutex_destroy(&namesMutex);
+    }
+
+    JobStats::timer::timer(JobStats &s, jobPhase p) : stats(s), phase(p) {
+        wall = seconds(CLOCK_MONOTONIC);
+        cpu = seconds(CLOCK_PROCESS_CPUTIME_ID); // all our threads
+        traced = stats.trace != NULL && stats.trace->enabled() ? stats.trace->now() : -1;
+    }
+
+    JobStats::timer::~timer() {
+        stats.wall[phase] += seconds(CLOCK_MONOTONIC) - wall;
+        stats.cpu[phase] += seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+        if (traced >= 0)
+            stats.trace->main_log().push_back(traceEvent{phaseNames[phase], 'X', traced, stats.trace->now() - traced,
+                                                         0, 0, ""});
+    }
+
+    int JobStats::counter_id(std::string_view name) {
+        pthread_mutex_lock(&namesMutex);
+        auto found = ids.find(name);
+        if (found == ids.end()) {
+            found = ids.emplace(std::string(name), (int) names.size()).first;
+            names.push_back(found->first);
+        }
+        int id = found->second;
+        pthread_mutex_unlock(&namesMutex);
+        return id;
+    }
+
+    void JobStats::merge(counterSlots &slots) {
+        for (size_t id = 0; id < slots.size(); id++) counter((int) id).add(slots[id].get());
+        slots.clear();
+    }
+
+    long JobStats::user_value(const std::string &name) {
+        auto found = ids.find(name);
+        return found == ids.end() || (size_t) found->second >= user.size() ? 0 : user[found->second].get();
+    }
+
+    std::vector<std::string> JobStats::user_names(MPI_Comm comm) {
+        /* ranks may have seen different counters: allgather the names (null terminated) and take the union */
+        int world_size;
+        MPI_Comm_size(comm, &world_size);
+        std::string mine;
+        for (auto &name : names) {
+            mine += name;
+            mine += '\0';
+        }
+        int size = (int) mine.size(), total = 0;
+        std::vector<int> counts(world_size), displs(world_size);
+        MPI_Allgather(&size, 1, MPI_INT, counts.data(), 1, MPI_INT, comm);
+        for (int i = 0; i < world_size; i++) {
+            displs[i] = total;
+            total += counts[i];
+        }
+        std::vector<char> all(total);
+        MPI_Allgatherv(mine.data(), size, MPI_CHAR, all.data(), counts.data(), displs.data(), MPI_CHAR, comm);
+        std::set<std::string> found;
+        for (int pos = 0; pos < total; pos += (int) found.insert(std::string(&all[pos])).first->size() + 1);
+        return std::vector<std::string>(found.begin(), found.end());
+    }
+
+    void JobStats::reduce_counters(MPI_Comm comm) {
+        std::vector<std::string> all = user_names(comm);
+        if (all.empty()) return;
+        std::vector<long> mine, sum(all.size());
+        for (auto &name : all) mine.push_back(user_value(name));
+        MPI_Reduce(mine.data(), sum.data(), (int) mine.size(), MPI_LONG, MPI_SUM, 0, comm);
+        for (size_t i = 0; i < all.size(); i++) summed[all[i]] = sum[i];
+    }
+
+    void JobStats::report(MPI_Comm comm, FILE *out) {
+        /* one vector of everything: phase wall times, phase CPU times, counters, peak RSS, user counters */
+        int nrank, world_size;
+        MPI_Comm_rank(comm, &nrank);
+        MPI_Comm_size(comm, &world_size);
+        std::vector<std::string> userNames = user_names(comm);
+        std::vector<double> mine;
+        for (int i = 0; i < NUM_PHASES; i++) mine.push_back(wall[i]);
+        for (int i = 0; i < NUM_PHASES; i++) mine.push_back(cpu[i]);
+        for (int i = 0; i < NUM_COUNTERS; i++) mine.push_back((double) counters[i]);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        mine.push_back(usage.ru_maxrss / 1024.0); // KB on linux
+        for (auto &name : userNames) mine.push_back((double) user_value(name));
+        std::vector<double> low(mine.size()), high(mine.size()), sum(mine.size());
+        MPI_Reduce(mine.data(), low.data(), (int) mine.size(), MPI_DOUBLE, MPI_MIN, 0, comm);
+        MPI_Reduce(mine.data(), high.data(), (int) mine.size(), MPI_DOUBLE, MPI_MAX, 0, comm);
+        MPI_Reduce(mine.data(), sum.data(), (int) mine.size(), MPI_DOUBLE, MPI_SUM, 0, comm);
+        if (nrank != 0) return;
+        fprintf(out, "%-16s %12s %12s %12s %12s %12s %12s\n", "phase (s)", "wall min", "wall max", "wall mean",
+                "cpu min", "cpu max", "cpu mean");
+        for (int i = 0; i < NUM_PHASES; i++) {
+            int c = NUM_PHASES + i;
+            fprintf(out, "%-16s %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n", phaseNames[i], low[i], high[i],
+                    sum[i] / world_size, low[c], high[c], sum[c] / world_size);
+        }
+        fprintf(out, "%-16s %12s %12s %12s %12s\n", "counter", "min", "max", "mean", "total");
+        for (int i = 0; i <= NUM_COUNTERS + (int) userNames.size(); i++) { // and peak RSS, and the user's
+            int c = 2 * NUM_PHASES + i;
+            const char *name = i < NUM_COUNTERS ? counterNames[i] : i == NUM_COUNTERS ? "peak RSS (MB)"
+                                                                                   : userNames[i - NUM_COUNTERS - 1].c_str();
+            fprintf(out, "%-16s %12.0f %12.0f %12.0f %12.0f\n", name, low[c], high[c], sum[c] / world_size, sum[c]);
+        }
+        fflush(out);
+    }
+
+}
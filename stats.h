@@ -0,0 +1,103 @@
+//
+// Created by timmytonga on 8/27/18.
+//
+
+#ifndef MAPREDUCECPP_STATS_H
+#define MAPREDUCECPP_STATS_H
+
+#include "mpi.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+enum jobPhase {             // what a rank's time goes to. Phases don't overlap
+    DISTRIBUTE_PHASE,       // master scanning the input and cutting splits (tasks are handed out during the map)
+    MAP_PHASE,              // map threads running, from spawn to join
+    COMBINE_PHASE,          // merging the map threads' pairs into one KeyValue
+    SHUFFLE_PHASE,          // moving pairs to their reducers (shuffle, sort_and_shuffle, tree reduction, streaming)
+    REDUCE_PHASE,           // the reduce function
+    WRITE_PHASE,            // writing the output
+    NUM_PHASES
+};
+
+enum jobCounter {
+    BYTES_READ,             // input bytes mapped
+    PAIRS_EMITTED,          // emit() calls during the map
+    BYTES_SENT,             // shuffled bytes sent to other ranks
+    BYTES_RECEIVED,         // shuffled bytes received from other ranks
+    NUM_COUNTERS
+};
+
+/* User counters: a name is interned once into an id (counter_id), and every thread has its own slots indexed by id,
+ * so add() is a plain increment of the calling thread's slot (no lock, no atomic, no lookup). The slots of the map
+ * threads are folded into the rank's JobStats when the map ends and at the end of the map and of the reduce all
+ * ranks' counters are added up with one reduce (see JobStats::reduce_counters). */
+class userCounter {
+public:
+    userCounter() : value(0) {}
+    void add(long n = 1) { value += n; }
+    long get() const { return value; }      // this slot only
+private:
+    long value;
+};
+
+typedef std::deque<userCounter> counterSlots; // indexed by counter id. A deque: references stay valid as it grows
+
+inline userCounter & counter_slot(counterSlots &slots, int id) {
+    if ((size_t) id >= slots.size()) slots.resize(id + 1);
+    return slots[id];
+}
+
+/* JobStats keeps the wall and CPU time of each phase and the job counters of one rank. Recording is a couple of
+ * clock_gettime calls per phase and plain adds (counters are only touched by the main thread), so it is always on.
+ * report() puts every rank side by side: min, max and mean across ranks, a big max/mean gap is load imbalance. */
+class JobStats {
+public:
+    JobStats();
+    ~JobStats();
+    void add(jobCounter c, long n) { counters[c] += n; }
+    void report(MPI_Comm comm, FILE *out);  // collective, rank 0 prints the table
+    int counter_id(std::string_view name);  // any thread: the id of a user counter (takes a lock, keep the id)
+    userCounter & counter(int id) { return counter_slot(user, id); }  // the main thread's slot
+    void merge(counterSlots &slots);        // fold a map thread's user counters in (and empty its slots)
+    void reduce_counters(MPI_Comm comm);    // collective, at the end of a phase: the ranks' user counters summed
+    const std::map<std::string, long> & totals() const { return summed; } // as of the last reduce_counters (rank 0)
+    void set_trace(Trace *t) { trace = t; } // phases also go on the timeline when t is enabled
+
+    class timer {           // adds the wall and CPU time of its scope to a phase
+    public:
+        timer(JobStats &stats, jobPhase phase);
+        ~timer();
+    private:
+        JobStats &stats;
+        jobPhase phase;
+        double wall, cpu;   // at construction
+        double traced;      // trace time at construction, -1 if not tracing
+    };
+
+private:
+    double wall[NUM_PHASES], cpu[NUM_PHASES];   // seconds
+    long counters[NUM_COUNTERS];
+    pthread_mutex_t namesMutex;             // map threads may intern names concurrently
+    std::vector<std::string> names;         // user counter names by id
+    std::map<std::string, int, std::less<>> ids; // less<>: look up by string_view, no copy
+    counterSlots user;                      // this rank's user counters (main thread and merged map threads)
+    std::map<std::string, long> summed;
+    Trace *trace;
+    std::vector<std::string> user_names(MPI_Comm comm); // every rank's counter names, sorted (same on all ranks)
+    long user_value(const std::string &name);           // this rank's count (0 if it never saw the name)
+};
+
+} // namespace
+
+#endif //MAPREDUCECPP_STATS_H
@@ -0,0 +1,125 @@
+//
+// Created by timmytonga on 8/29/18.
+//
+
+#include "trace.h"
+#include "errors.h"
+
+#include <sys/stat.h>
+#include <time.h>
+#include <cstdio>
+#include <set>
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+    static double microseconds() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+    }
+
+    void json_arg(std::string &args, const char *key, long value) {
+        if (!args.empty()) args += ',';
+        args += '"';
+        args += key;
+        args += "\":";
+        args += std::to_string(value);
+    }
+
+    void json_arg(std::string &args, const char *key, std::string_view value) {
+        if (!args.empty()) args += ',';
+        args += '"';
+        args += key;
+        args += "\":\"";
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                args += '\\';
+                args += c;
+            } else if ((unsigned char) c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                args += escaped;
+            } else {
+                args += c;
+            }
+        }
+        args += '"';
+    }
+
+    void Trace::enable(MPI_Comm comm, const std::string &dir) {
+        MPI_Comm_rank(comm, &rank);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) errno_abort("Unable to create trace directory");
+        char name[32];
+        snprintf(name, sizeof(name), "/trace-r-%05d.json", rank);
+        path = dir + name;
+        MPI_Barrier(comm); // everybody leaves at about the same time: good enough a common zero for a timeline
+        start = microseconds();
+        on = true;
+    }
+
+    double Trace::now() const {
+        return microseconds() - start;
+    }
+
+    void Trace::merge(traceLog &log) {
+        events.insert(events.end(), log.begin(), log.end());
+        traceLog().swap(log);
+    }
+
+    long Trace::begin_async(const char *name, const std::string &args) {
+        if (!on) return -1;
+        long id = ((long) rank << 32) | nextId++; // unique across the ranks' files
+        events.push_back(traceEvent{name, 'b', now(), 0, 0, id, args});
+        return id;
+    }
+
+    void Trace::end_async(const char *name, long id) {
+        if (on && id >= 0) events.push_back(traceEvent{name, 'e', now(), 0, 0, id, ""});
+    }
+
+    void Trace::write() {
+        if (!on) return;
+        FILE *out = fopen(path.c_str(), "w");
+        if (out == NULL) errno_abort("Unable to open trace file");
+        // name the process and threads so the timeline reads "rank 3 / map thread 2"
+        fprintf(out, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"rank %d\"}},\n"
+                     "{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"sort_index\":%d}}",
+                rank, rank, rank, rank);
+        std::set<int> threads;
+        for (auto &e : events) threads.insert(e.thread);
+        for (int t : threads) {
+            fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", rank, t);
+            if (t == 0) fprintf(out, "\"main\"}}");
+            else fprintf(out, "\"map thread %d\"}}", t - 1);
+        }
+        for (auto &e : events) {
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d", e.name, e.ph, e.ts, rank,
+                    e.thread);
+            if (e.ph == 'X') fprintf(out, ",\"dur\":%.3f", e.dur);
+            else fprintf(out, ",\"cat\":\"mpi\",\"id\":\"0x%lx\"", e.id);
+            if (!e.args.empty()) fprintf(out, ",\"args\":{%s}", e.args.c_str());
+            fputc('}', out);
+        }
+        fprintf(out, "\n]\n");
+        if (fclose(out) != 0) errno_abort("Unable to write trace file");
+    }
+
+    Trace::span::span(Trace &t, traceLog &l, const char *n, int thread)
+            : trace(t), log(l), name(n), thread(thread), begin(t.on ? t.now() : 0) {}
+
+    Trace::span::~span() {
+        if (trace.on) log.push_back(traceEvent{name, 'X', begin, trace.now() - begin, thread, 0, std::move(args)});
+    }
+
+    Trace::span &Trace::span::arg(const char *key, long value) {
+        if (trace.on) json_arg(args, key, value);
+        return *this;
+    }
+
+    Trace::span &Trace::span::arg(const char *key, std::string_view value) {
+        if (trace.on) json_arg(args, key, value);
+        return *this;
+    }
+
+}
@@ -0,0 +1,75 @@
+//
+// Created by timmytonga on 8/29/18.
+//
+
+#ifndef MAPREDUCECPP_TRACE_H
+#define MAPREDUCECPP_TRACE_H
+
+#include "mpi.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+struct traceEvent {
+    const char *name;       // a string literal
+    char ph;                // 'X' a span, 'b'/'e' begin/end of an async span (non-blocking sends and receives overlap)
+    double ts, dur;         // microseconds since the trace started
+    int thread;             // 0 is the main thread, map threads are 1, 2, ...
+    long id;                // pairs an async 'b' with its 'e'
+    std::string args;       // JSON members shown with the event, e.g. "bytes":1024
+};
+
+typedef std::vector<traceEvent> traceLog; // each map thread records in its own, merged after join: no locking
+
+/* Opt-in timeline of what every rank and thread did, in the Chrome trace event format (chrome://tracing or
+ * ui.perfetto.dev). Each rank writes dir/trace-r-%05d.json (one JSON array, pid = rank, tid = thread) when the
+ * MapReduce goes away; the files are merged with e.g. jq -s add dir/trace-r-*.json > trace.json.
+ * When it's off a span costs a branch and nothing is formatted. */
+class Trace {
+public:
+    Trace() : on(false), rank(0), start(0), nextId(0) {}
+    void enable(MPI_Comm comm, const std::string &dir); // collective: a barrier lines up the ranks' clocks
+    bool enabled() const { return on; }
+    double now() const;                     // microseconds since enable
+    traceLog & main_log() { return events; }
+    void merge(traceLog &log);              // take a map thread's events
+    long begin_async(const char *name, const std::string &args); // main thread only
+    void end_async(const char *name, long id);
+    void write();                           // this rank's file
+
+    class span {            // records its scope as one event (if tracing is on)
+    public:
+        span(Trace &trace, const char *name) : span(trace, trace.events, name, 0) {}
+        span(Trace &trace, traceLog &log, const char *name, int thread);
+        ~span();
+        span & arg(const char *key, long value);
+        span & arg(const char *key, std::string_view value);
+    private:
+        Trace &trace;
+        traceLog &log;
+        const char *name;
+        int thread;
+        double begin;
+        std::string args;
+    };
+
+private:
+    bool on;
+    int rank;
+    double start;           // CLOCK_MONOTONIC microseconds at enable
+    long nextId;
+    std::string path;
+    traceLog events;        // the main thread's, and the map threads' once merged
+};
+
+// append "key":value to a JSON argument list
+void json_arg(std::string &args, const char *key, long value);
+void json_arg(std::string &args, const char *key, std::string_view value);
+
+} // namespace
+
+#endif //MAPREDUCECPP_TRACE_H
@@ -0,0 +1,108 @@
+//
+// Created by timmytonga on 8/6/18.
+//
+
+#ifndef MAPREDUCECPP_WORKDEQUE_H
+#define MAPREDUCECPP_WORKDEQUE_H
+
+#include <atomic>
+#include <vector>
+
+
+namespace MAPREDUCE_NAMESPACE {
+
+/* Chase-Lev work stealing deque (with the C11 memory orderings of Le, Pop, Cohen and Nardelli, PPoPP'13).
+ * The owner thread push()es and pop()s at the bottom without any lock; other threads steal() from the top
+ * and only contend on a single CAS when the deque is nearly empty. T should be small and trivially copyable
+ * (map tasks are indices into a task list). The buffer grows when full; retired buffers are kept until the
+ * deque is destroyed since a thief may still be reading them. */
+template<class T>
+class WorkDeque {
+public:
+    explicit WorkDeque(long capacity = 64) : top(0), bottom(0) {
+        long cap = 1;
+        while (cap < capacity) cap <<= 1; // power of two so we can mask instead of mod
+        array.store(new Array(cap), std::memory_order_relaxed);
+    }
+    ~WorkDeque() {
+        delete array.load(std::memory_order_relaxed);
+        for (auto a : retired) delete a;
+    }
+    WorkDeque(const WorkDeque &) = delete;
+    WorkDeque & operator=(const WorkDeque &) = delete;
+
+    void push(const T &item) { // owner only
+        long b = bottom.load(std::memory_order_relaxed);
+        long t = top.load(std::memory_order_acquire);
+        Array *a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) a = grow(a, t, b);
+        a->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    bool pop(T &item) { // owner only: newest task first (LIFO)
+        long b = bottom.load(std::memory_order_relaxed) - 1;
+        Array *a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long t = top.load(std::memory_order_relaxed);
+        if (t > b) { // empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        item = a->get(b);
+        if (t == b) { // last item: race against thieves for it
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    bool steal(T &item) { // any thread: oldest task first (FIFO). Only returns false if the deque was empty
+        while (1) {
+            long t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            long b = bottom.load(std::memory_order_acquire);
+            if (t >= b) return false;
+            Array *a = array.load(std::memory_order_acquire);
+            item = a->get(t);
+            if (top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return true;
+            // lost the race to the owner or another thief, look again
+        }
+    }
+
+    long size() const { // approximate when other threads are active
+        long b = bottom.load(std::memory_order_relaxed);
+        long t = top.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+private:
+    struct Array {
+        long capacity;
+        std::atomic<T> *buf;
+        explicit Array(long cap) : capacity(cap), buf(new std::atomic<T>[cap]) {}
+        ~Array() { delete[] buf; }
+        T get(long i) const { return buf[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void put(long i, const T &item) { buf[i & (capacity - 1)].store(item, std::memory_order_relaxed); }
+    };
+
+    Array * grow(Array *a, long t, long b) { // owner only
+        Array *bigger = new Array(a->capacity * 2);
+        for (long i = t; i < b; i++) bigger->put(i, a->get(i));
+        retired.push_back(a);
+        array.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    std::atomic<long> top, bottom;
+    std::atomic<Array *> array;
+    std::vector<Array *> retired;   // only touched by the owner
+};
+
+} // namespace
+
+#endif //MAPREDUCECPP_WORKDEQUE_H